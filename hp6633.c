@@ -39,10 +39,48 @@
  2016-02-17     updated doc (JHa)
  2017-01-23     minor bug fix around keyboard handling (JHa)
  2025-08-11     moved everything to GitHub (JHa)
+ 2026-10-17     added GPIB link probe (-C) and automatic sampling rate
+                (-t a); sampling now runs on a fixed time grid
+ 2026-10-17     configurable and adaptive GPIB timeout (-T); replies are
+                read up to EOI/LF instead of a fixed 11 bytes
+ 2026-10-17     retry and re-open instrument on GPIB errors (-E)
+ 2026-10-17     data file is committed with CRC and checkpoint, so that
+                an interrupted run can be resumed (-A)
+ 2026-10-17     data file can be split into segments by size or time
+                (-S, -L), finished segments can be compressed (-Z)
+ 2026-10-17     binary output file, written through mmap (-B)
+ 2026-10-17     data file can be written by a separate thread (-W)
+ 2026-10-17     data can be sent to more outputs: text files, stdout,
+                and TCP clients (-O)
+ 2026-10-17     status line is refreshed at a fixed rate (-v)
+ 2026-10-17     live chart in the terminal, without gnuplot (-G)
+ 2026-10-17     gnuplot is fed through a non-blocking pipe
+ 2026-10-17     periodic PNG/SVG snapshots of the plot (-s)
+ 2026-10-17     readings, ramp and statistics in fixed point, ramp
+                stays within -u ... -U
+ 2026-10-17     ramp runs from a table of setpoints, next setpoint
+                is sent right after the reading; settle time (-d)
+ 2026-10-17     job list: several runs on one device and gnuplot (-j)
+ 2026-10-17     GPIB board can be shared with other processes (-X)
+ 2026-10-17     further supplies follow the setpoints, all set at
+                once (-y)
+ 2026-10-17     times of each reading, current aligned to voltage (-x)
+ 2026-10-17     derived channels: power, resistance, and dV/dI over a
+                sliding window (-P)
+ 2026-10-17     quantiles and histogram of the current (-H)
+ 2026-10-17     adaptive sampling: fast while the readings change,
+                slower when they do not (-N)
+ 2026-10-17     summary files with min/mean/max/Ah per minute, hour,
+                ... (-m)
+ 2026-10-17     limit rules with pass/fail verdict, switching off or
+                stopping on violation (-l); delivered charge
+ 2026-10-17     ramp ends (or turns) early in current limit (-e) or
+                off a reference curve (-z)
+ 2026-10-17     CC-CV charge mode with taper, charge and time limit (-Q)
  
  This should compile with any C compiler, something like:
 
- gcc hp6633.c -Wall -O2 -lgpib -o hp6633 
+ gcc hp6633.c -Wall -O2 -lgpib -lm -lpthread -o hp6633 
 
  You may want to rename the output file if you use a 6632 or 6634 ;-)
 
@@ -50,28 +88,105 @@
 
  */
 
+#define _GNU_SOURCE         /* fopencookie() */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <time.h>
 #include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <limits.h>         /* LONG_MIN */
 #include <errno.h>          /* command line reading */
 #include <unistd.h>
 #include <termios.h>        /* kbhit() */
+#include <sys/ioctl.h>      /* terminal size */
 #include <sys/io.h>
 #include <sys/time.h>       /* clock timing */
+#include <sys/types.h>      /* truncate() */
+#include <sys/wait.h>       /* waitpid() */
+#include <sys/mman.h>       /* binary log */
+#include <sys/file.h>       /* flock() */
+#include <sys/stat.h>       /* stat() */
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>     /* live feed */
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include "gpib/ib.h"
 
-#define VERSION "V20250811"    /* String! */
+#define VERSION "V20261017"    /* String! */
 #define GNUPLOT "gnuplot"      /* gnuplot executable */
+#define PLOT_BUF 4096          /* commands queued for a slow gnuplot */
+#define PLOT_PIPE 4096         /* pipe to gnuplot: one page, so that a busy one is noticed */
+#define SNAP_NICE 10           /* priority of gnuplot for snapshots */
 
 #define MAXLEN   81         /* text buffers etc */
 #define ESC      27
 
 #define ERR_FILE  4         /* error code */
 #define ERR_INST  5         /* error code */
+#define ERR_LIMIT 2         /* error code: a limit rule was violated */
 
 #define GPIB_BOARD_ID 0     /* GPIB card #, default is 0 */
 
+#define GPIB_EOS     '\n'   /* instrument terminates replies with CR/LF */
+#define TMO_MIN      0.01   /* lower bound for adaptive timeout (s) */
+#define BUS_LOCK     "/tmp/hp6633-gpib%d.lock"  /* lock file per board */
+#define MAXRAILS     8      /* further supplies set together with the main one */
+
+#define RETRY_MAX     3     /* retries before re-opening the device */
+#define RETRY_WAIT    0.1   /* wait before first retry (s) ... */
+#define RETRY_MAXWAIT 5.0   /* ... doubling up to this limit (s) */
+
+#define COMPRESS  "gzip"     /* compressor for finished segments */
+
+#define WR_BUFSIZE (64*1024)    /* data file writer: buffer size ... */
+#define WR_NBUF    3            /* ... and number of buffers */
+
+#define MAXSINKS   8            /* additional outputs ... */
+#define MAXCLIENTS 8            /* ... TCP clients per output ... */
+#define SINK_BUF   4096         /* ... and data kept for a slow reader */
+
+#define MAXTIERS   4            /* summary files */
+
+#define BIN_MAGIC   "HP6633B"   /* binary log: file ID ... */
+#define BIN_VERSION 1           /* ... and format version */
+#define BIN_EXTENT  (16L*1024L*1024L) /* file grows in steps of 16 MB */
+#define BIN_SYNC    1           /* sync to disk every ... s */
+
+#define STATUS_HZ     10    /* default refresh rate of status line */
+
+#define FIX_SCALE   10000L  /* fixed point: units of 0.1 mV, 0.1 mA */
+#define FIX(x)      lround((x) * FIX_SCALE)     /* V or A to fixed point */
+#define NS_TICK     6000000LL   /* 0.0001 min in ns, for the data file */
+
+#define TRACE_LEN   1024    /* points kept in memory for the live chart */
+#define TUI_HZ      4       /* max. refresh rate of terminal chart */
+#define TUI_MAXROWS 100
+
+#define DERIVE_MAX  10000   /* max. window for dV/dI (-P) */
+#define HIST_DEC    4       /* histogram of current: buckets per decade ... */
+#define HIST_LEN    (5*HIST_DEC)    /* ... from 0.1 mA to 10 A */
+#define HIST_BAR    40      /* length of longest bar shown */
+
+#define JOB_LEN     1024    /* max. length of a line in the job list */
+#define JOB_ARGS    128     /* max. words of cmd line plus job */
+
+#define MAXRULES    8       /* limit rules (-l) */
+#define CC_DROP     500L    /* -e: current limit if V is 50 mV below setpoint ... */
+#define CC_SHARE    0.99    /* ... and I is at 99 % of the limit */
+#define REF_TOL     10.0    /* -z: default tolerance, mA ... */
+#define REF_COUNT   3       /* ... and readings off the curve to end the ramp */
+#define REF_NONE    LONG_MIN    /* no reference for this setpoint */
+#define CHG_COUNT   3       /* -Q: readings below taper current to end charge */
+
+#define ADAPT_GROW  2.0     /* -N: quiet readings stretch the interval by this */
+
+#define PROBE_DEFAULT 20    /* VOUT?/IOUT? pairs probed for '-t a' */
+#define PROBE_MARGIN  1.25  /* safety margin on probed sample time */
+
 /* --- specific settings for HP6632, 6634, 6635 --- */
 
 #define HP6633
@@ -108,29 +223,374 @@ void    close_keyboard(void);
 int     kbhit(void);
 int     readch(void);
 
+/* --- GPIB timeout handling ---- */
+
+static  const double tmo_sec[] =    /* duration of T10us ... T1000s (s) */
+    { 0.0, 10e-6, 30e-6, 100e-6, 300e-6, 1e-3, 3e-3, 10e-3, 30e-3,
+      0.1, 0.3, 1.0, 3.0, 10.0, 30.0, 100.0, 300.0, 1000.0 };
+static  int     gpib_tmo = T1s,     /* timeout in use */
+                gpib_tmo_max = T1s; /* upper limit when adapting */
+static  char    gpib_adapt = 0;     /* adapt timeout to observed latency */
+static  double  gpib_srtt = 0.0,    /* smoothed latency (s) ... */
+                gpib_rttvar = 0.0;  /* ... and its mean deviation (s) */
+
+int     tmo_code (const double sec);
+void    gpib_latency (const int inst, const double lat);
+
+/* --- sharing the GPIB board with other processes ---- */
+
+static  int     bus_fd = -1,        /* lock file, -1 if not used */
+                bus_depth = 0;      /* nesting of bus_lock() */
+static  unsigned long bus_n = 0L,   /* transactions, ... */
+                bus_waits = 0L;     /* ... how many had to wait, ... */
+static  double  bus_wait_sum = 0.0, /* ... and how long (s) */
+                bus_wait_max = 0.0;
+
+int     bus_open (const int board);
+void    bus_lock (void);
+void    bus_unlock (void);
+int     bus_wrt (const int inst, const char *buf);
+
+/* --- crash-safe logging ---- */
+
+struct checkpoint           /* all we need to resume an interrupted run */
+    {
+    long    offset;         /* committed length of data file */
+    unsigned long crc;      /* CRC-32 of data file up to offset */
+    unsigned long loop;     /* sample count */
+    long long t0;           /* time base, ns since The Epoch */
+    int     step;           /* ramp position (index to setpoints) */
+    char    dramp_avail;
+    unsigned long retries, reconnects;
+    int     segment;        /* number of current segment ... */
+    unsigned long seg_first;/* ... its first sample ... */
+    double  seg_t;          /* ... and its start, min */
+    long    binpos;         /* length of binary log */
+    long long amp_sum;      /* statistics of current (fixed point) */
+    long    amp_min, amp_max;
+    double  charge;         /* delivered charge, Ah */
+    int     violated;       /* a limit rule was violated: ... */
+    char    rule[MAXLEN];   /* ... the first one, as given, ... */
+    double  t_violated;     /* ... and when, min */
+    };
+
+unsigned long crc32_update (unsigned long crc, const unsigned char *buf, size_t len);
+struct writer               /* data file, evtl. written by a thread */
+    {
+    int     fd;
+    long    pos;            /* bytes written so far ... */
+    unsigned long crc;      /* ... and their CRC-32 */
+    char    async;          /* use writer thread */
+    char    *buf[WR_NBUF];  /* async only: buffers, ... */
+    size_t  fill[WR_NBUF];  /* ... bytes in them, ... */
+    char    sync[WR_NBUF];  /* ... and if to fsync() after writing, ... */
+    struct checkpoint cp[WR_NBUF]; /* ... then save this checkpoint */
+    const char *statename;  /* checkpoint file */
+    int     cur,            /* buffer being filled */
+            head,           /* oldest buffer waiting to be written ... */
+            queued;         /* ... and number of waiting buffers */
+    long    wpos;           /* file position of next write */
+    int     stop, err;      /* tell thread to finish, error flag */
+    pthread_t thread;
+    pthread_mutex_t lock;   /* protects the above */
+    pthread_cond_t cond;
+    unsigned long writes,   /* statistics: buffers written, ... */
+            stalls;         /* ... times no buffer was free, ... */
+    int     maxqueue;       /* ... max. buffers waiting, ... */
+    double  lat_sum, lat_max; /* ... time to write a buffer (s) */
+    };
+
+FILE    *wr_open (struct writer *w, const char *name, const long pos,
+                  const unsigned long crc, const char async);
+int     wr_sync (struct writer *w, const struct checkpoint *cp);
+ssize_t wr_write (void *cookie, const char *data, size_t n);
+int     wr_close (void *cookie);
+int     wr_submit (struct writer *w, const struct checkpoint *cp);
+void    *wr_thread (void *arg);
+
+int     log_commit (FILE *f, struct writer *w, struct checkpoint *cp);
+int     log_verify (const char *name, const struct checkpoint *cp);
+int     state_save (const char *name, const struct checkpoint *cp);
+int     state_load (const char *name, struct checkpoint *cp);
+void    log_header (FILE *f, const char *comment, const char *info, const char *columns,
+                    const struct checkpoint *cp, const char segmented);
+void    log_list (const char *base, const char *name, const struct checkpoint *cp,
+                  const unsigned long last, const double t1);
+FILE    *log_segment (FILE *f, struct writer *w, const char *base, char *segname, struct checkpoint *cp,
+                      const double t1, const char do_compress);
+
+/* --- binary log ---- */
+
+struct binhdr               /* header of binary log, 32 bytes */
+    {
+    char    magic[8];       /* BIN_MAGIC */
+    int     version;        /* BIN_VERSION */
+    int     recsize;        /* sizeof(struct binrec) */
+    long long t0;           /* time base, ns since The Epoch */
+    double  reserved;
+    };
+
+struct binrec               /* one sample, 16 bytes */
+    {
+    long long t;            /* ns since t0 */
+    int     volt, amp;      /* 0.1 mV, 0.1 mA */
+    };
+
+struct binlog               /* an open binary log */
+    {
+    int     fd;
+    char    *map;           /* mapping of the file ... */
+    size_t  len;            /* ... its length ... */
+    volatile size_t pos;    /* ... and the part in use */
+    volatile int stop;      /* tell sync thread to finish */
+    pthread_t thread;       /* sync thread */
+    pthread_mutex_t lock;   /* protects map and len */
+    };
+
+int     binlog_open (struct binlog *bl, const char *name, const long long t0, const long pos);
+int     binlog_write (struct binlog *bl, const long long t, const long volt, const long amp);
+int     binlog_close (struct binlog *bl);
+void    *binlog_sync (void *arg);
+
+/* --- additional outputs ---- */
+
+enum { SINK_FILE, SINK_STDOUT, SINK_TCP };
+
+struct stream               /* non-blocking output */
+    {
+    int     fd;
+    char    buf[SINK_BUF];  /* data not yet written ... */
+    size_t  fill;           /* ... and their number */
+    unsigned long drops;    /* lines dropped */
+    };
+
+struct sink                 /* additional output */
+    {
+    char    type;           /* SINK_FILE ... */
+    char    name[MAXLEN];
+    FILE    *f;             /* text file ... */
+    struct writer w;        /* ... and its writer */
+    int     lfd;            /* TCP: listening socket */
+    struct stream s[MAXCLIENTS]; /* stdout, or TCP clients ... */
+    int     n;              /* ... and their number */
+    int     flags;          /* stdout: file status flags to restore, -1 if none */
+    char    head[2*MAXLEN+4];   /* column titles, for each new reader */
+    unsigned long drops;    /* lines dropped */
+    };
+
+int     sink_open (struct sink *k, const char *spec, const char *columns, const char append);
+void    sink_put (struct sink *k, const int n, const char *line);
+void    sink_flush (struct sink *k, const int n);
+void    sink_close (struct sink *k, const int n);
+int     stream_put (struct stream *s, const char *data, size_t len);
+
+/* --- summary files ---- */
+
+struct tier                 /* one summary file */
+    {
+    int     len;            /* length of bucket, min */
+    FILE    *f;
+    char    name[MAXLEN+8];
+    long long bucket,       /* current bucket, -1 if none */
+            vsum, isum,     /* sums of readings ... */
+            tlast;          /* ... and time of last one, ns */
+    unsigned long n;        /* readings in bucket */
+    long    vmin, vmax, imin, imax, ilast;  /* fixed point */
+    double  ah;             /* charge in bucket, Ah */
+    };
+
+int     tier_open (struct tier *t, const int n, const char *base, const char *comment,
+                   const char resume);
+void    tier_add (struct tier *t, const int n, const long long tns, const long volt,
+                  const long amp, const char gap);
+void    tier_write (struct tier *t);
+void    tier_flush (struct tier *t, const int n);
+void    tier_close (struct tier *t, const int n);
+
+/* --- gnuplot ---- */
+
+struct plot
+    {
+    int     fd;             /* pipe to gnuplot, -1 if none */
+    pid_t   pid;
+    char    buf[PLOT_BUF];  /* commands not yet taken */
+    size_t  len;
+    int     ack;            /* pipe from gnuplot's stdout, -1 if none ... */
+    int     pending;        /* ... and jobs it has not yet acknowledged */
+    unsigned long skipped;  /* refreshes skipped */
+    };
+
+int     plot_open (struct plot *p, const char *cmd, const int prio, const char ack);
+void    plot_pump (struct plot *p);
+int     plot_ack (struct plot *p, const char wait);
+int     plot_printf (struct plot *p, const char drop, const char *fmt, ...);
+void    plot_close (struct plot *p);
+
+/* --- live chart in the terminal ---- */
+
+struct trace                /* decimated copy of the data */
+    {
+    float   x[TRACE_LEN], y1[TRACE_LEN], y2[TRACE_LEN];
+    int     n,              /* points in trace */
+            dec,            /* one point is taken of ... */
+            skip;           /* ... and so many were skipped */
+    };
+
+struct tui                  /* chart made of braille characters */
+    {
+    FILE    *term;
+    int     rows, cols;     /* size of terminal */
+    unsigned char *cell,    /* dots shown ... */
+            *next;          /* ... and to be shown */
+    char    label[TUI_MAXROWS][MAXLEN],  /* text to be shown ... */
+            shown[TUI_MAXROWS][MAXLEN];  /* ... and shown */
+    double  tlast;          /* time of last frame */
+    };
+
+void    trace_add (struct trace *tr, const float x, const float y1, const float y2);
+void    tui_open (struct tui *ui, FILE *term);
+void    tui_draw (struct tui *ui, const struct trace *tr, const char ramp);
+void    tui_panel (struct tui *ui, const int top, const int height,
+                   const float *x, const float *y, const int n,
+                   const char *name, const char *unit, const char *xunit);
+void    tui_close (struct tui *ui);
+int     snapshot (struct plot *p, const struct trace *tr, const char *base,
+                  const char svg, const char ramp, const char force);
+
+/* --- derived channels ---- */
+
+struct derive               /* dV/dI by linear regression over a window */
+    {
+    int     n,              /* size of window, 0 if off */
+            k,              /* next slot ... */
+            fill;           /* ... and slots used */
+    long    *v, *i;         /* readings in window, fixed point */
+    long long sv, si, sii, siv;     /* their sums */
+    };
+
+int     derive_open (struct derive *d, const int n);
+int     derive_add (struct derive *d, const long v, const long i, long *slope);
+void    derive_close (struct derive *d);
+
+/* --- distribution of the current ---- */
+
+struct p2                   /* P-square estimator of one quantile */
+    {
+    double  prob,           /* quantile to be estimated */
+            q[5],           /* marker heights, ... */
+            n[5],           /* ... positions, ... */
+            np[5],          /* ... desired positions ... */
+            dn[5];          /* ... and their increments */
+    unsigned long count;
+    };
+
+struct hist                 /* histogram with logarithmic buckets */
+    {
+    unsigned long below,    /* readings <= 0 */
+            n[HIST_LEN];    /* readings in bucket */
+    };
+
+void    p2_init (struct p2 *p, const double prob);
+void    p2_add (struct p2 *p, const double x);
+double  p2_get (const struct p2 *p);
+void    hist_add (struct hist *h, const long amp);
+void    hist_print (const struct hist *h, FILE *con, FILE *f);
+
+/* --- limit rules ---- */
+
+#define RULE_FAIL   0       /* on violation: just mark as failed ... */
+#define RULE_OFF    1       /* ... and switch output off ... */
+#define RULE_STOP   2       /* ... or stop the run */
+#define RULE_NVAL   5       /* quantities: V, I, P, Imean, Ah */
+
+struct rule
+    {
+    int     what;           /* index of quantity */
+    char    op;             /* '<' or '>' */
+    double  lim;            /* limit, V, A, W or Ah */
+    int     action;         /* RULE_xxx */
+    unsigned long hits;     /* readings violating it */
+    char    text[MAXLEN];   /* as given */
+    };
+
+int     rule_parse (struct rule *r, const char *spec);
+int     rule_check (const struct rule *r, const double *val);
+
 /* --- miscellaneous function prototypes ---- */
 
 double  timeinfo (void);
+long long clock_ns (void);
+int     fix_parse (const char *s, long *val);
+long    *ramp_table (const long lo, const long hi, const long inc, const char dual,
+                     int *n, int *turn);
+long    *ref_table (const char *name, const long *tab, const int n);
+char    *fix_put (char *p, long long val);
+int     cmp_double (const void *a, const void *b);
 int     strclean (char *buf);
 int     GetOpt (int argc, char *argv[], char *optionS);
 
 /* --- hp663X-related function prototypes ---- */
 
 int     hp663X_open (const int adr, const char do_reset);
-int 	hp663X_set (const int inst, const char cmd[], const float val);
+int 	hp663X_set (const int inst, const char cmd[], const long val);
 int     hp663X_setup (const int inst, const float volt, \
                      const float amp, const float limvolt, const char ocp);
 int     hp663X_read (const int inst, const char what[], char *result);
+int     hp663X_measure (const int inst, long *volt, long *amp, long long *ts);
+int     hp663X_probe (const int inst, const int n, double *lat);
 int     hp663X_close (const int adr, const char do_reset);
 
+/* --- several supplies set together ---- */
+
+struct rails
+    {
+    int     n,              /* number of further supplies */
+            pad[MAXRAILS],  /* their GPIB addresses ... */
+            dev[MAXRAILS];  /* ... and devices */
+    Addr4882_t list[MAXRAILS+2];    /* main supply, rails, NOADDR */
+    char    group;          /* all are set with one message */
+    unsigned long updates;  /* setpoints sent, ... */
+    double  skew_sum,       /* ... and time from first to last (s) */
+            skew_max;
+    };
+
+int     rails_open (struct rails *r, const int pad, const char do_reset);
+int     rails_set (struct rails *r, const int inst, const char cmd[], const long val);
+void    rails_close (struct rails *r, const char do_reset);
+int     hp663X_recover (int *inst, struct rails *r, const int pad, const int fails, const int max_reconnect,
+                        const float volt, const float amp, const float limvolt, const char ocp);
+
+/* --- job list ---- */
+
+struct session              /* shared by the runs of a job list */
+    {
+    int     inst, pad;      /* open device, 0 if none */
+    struct plot gp;         /* gnuplot, fd -1 if none */
+    char    last,           /* this is the last run */
+            abort,          /* user has stopped it */
+            reset,          /* -k not given in the current run */
+            started;        /* current run got to acquisition */
+    int     runs,           /* runs started ... */
+            done;           /* ... and done */
+    double  tend,           /* end of last run */
+            idle;           /* total time between runs, s */
+    };
+
+int     hp6633_run (int argc, char *argv[], struct session *ss);
+int     job_split (char *line, char *av[], const int max);
+
 
 
 /********************************************************
-* main:       main program loop.                        *
-* Input:      see below.                                *
+* hp6633_run: One run: set up, acquire, clean up. The   *
+*             device and gnuplot are taken over from    *
+*             the previous run of a job list, and kept  *
+*             open for the next one.                    *
+* Input:      - cmd line (see below)                    *
+*             - ptr to session                          *
 * Return:     0 if OK, else error code                  *
 ********************************************************/
-int main (int argc, char *argv[])
+int hp6633_run (int argc, char *argv[], struct session *ss)
 {
 static char *disclaimer =
 "\nhp6633 - Control of the HP6633A Power Supply over GPIB. " VERSION ".\n"
@@ -142,9 +602,10 @@ static char *disclaimer =
 "WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A\n"
 "PARTICULAR PURPOSE. See the GNU General Public License for details.\n\n";
 
-static char *msg = "\nSyntax: %s [-h] [-a id] [-u setV] [-U upperV] [-M maxV] [-i A] [-I] [-r dV] [-R] [-t dt] [-k] [-K] [-c txt] [-n | -g /path/to/gnuplot] [-f] outfile"
+static char *msg = "\nSyntax: %s [-h] [-a id] [-y ids] [-u setV] [-U upperV] [-M maxV] [-i A] [-I] [-r dV] [-R] [-d ms] [-e n] [-z file[,tol]] [-t dt] [-N max,dV,dI] [-Q I[,Ah[,min]]] [-C n] [-T ms] [-E n] [-k] [-K] [-c txt] [-S MB] [-L min] [-Z] [-B binfile] [-W] [-D] [-O out] [-m min] [-v Hz] [-x t|a] [-P n] [-H] [-l rule] [-X] [-s min[,svg]] [-G | -n | -g /path/to/gnuplot] [-f | -A] outfile | -j jobfile"
 "\n        -h       this help screen"
 "\n        -a id    use instrument at GPIB address 'id' (default is 5)"
+"\n        -y ids   further supplies at GPIB addresses 'ids' (e.g. 6,7) follow -u/-U/-r"
 "\n        -u V     set actual voltage to 'V' Volt"
 "\n        -U V     set upper ramp voltage to 'V' Volt"
 "\n        -M V     set voltage limiter to 'V' Volt"
@@ -152,43 +613,191 @@ static char *msg = "\nSyntax: %s [-h] [-a id] [-u setV] [-U upperV] [-M maxV] [-
 "\n        -I       enable overcurrent trip (default off)"
 "\n        -r dV    ramp voltage by increment 'dV' mV (default 0 mV)"
 "\n        -R       run ramp up and down (default is one-way)"
+"\n        -d ms    ramp: read 'ms' after each step instead of on the -t grid"
+"\n        -e n     ramp: end (or, with -R, turn) after 'n' readings in current limit"
+"\n        -z f,tol ramp: end when current is 'tol' mA (default 10) off the curve in file 'f'"
 "\n        -t dt    delay between measurements or steps in 0.1 s (default is 10;"
-"\n                 '0' quits after setting parameters and implies -k and -n)"
+"\n                 '0' quits after setting parameters and implies -k and -n,"
+"\n                 'a' selects the fastest rate the GPIB link can sustain)"
+"\n        -N max,dV,dI  sample at -t while readings change by more than 'dV' mV or"
+"\n                 'dI' mA, else slow down up to 'max' s"
+"\n        -Q I,Ah,min  charge at -i up to -u, end when current drops below 'I' A"
+"\n                 in CV, or after 'Ah' or 'min' (0 = no limit)"
+"\n        -C n     probe GPIB link with 'n' readings before start (default 0)"
+"\n        -T ms    GPIB timeout in ms (default 1000), 'a' adapts it to the link"
+"\n        -E n     on GPIB errors, retry and re-open device up to 'n' times (default 0)"
+"\n        -x t|a   log start and end of each reading ('t'), and align current to voltage ('a')"
+"\n        -P n     log power, resistance, and dV/dI over the last 'n' readings"
+"\n        -H       track median, 99 % and 99.9 % quantile and histogram of current"
+"\n        -l rule  fail if e.g. 'I>0.5' or 'V<4.8:off' (V, I, P, Imean, Ah; then"
+"\n                 'fail', 'off' or 'stop', default stop); may be given several times"
+"\n        -X       share GPIB board with other hp6633 processes (see README)"
 "\n        -k       keep settings before and after run (default: switches off)"
 "\n        -K       do not ask for keypress before exit (default: wait for key)"
 "\n        -w x     force write to disk every x samples (default 100)"
 "\n        -f       force overwriting of existing output file"
+"\n        -A       resume interrupted run, appending to output file"
+"\n        -S MB    start new segment of output file after 'MB' Megabytes"
+"\n        -L min   start new segment of output file every 'min' minutes"
+"\n        -Z       compress finished segments with " COMPRESS
+"\n        -B file  additionally write binary data to 'file'"
+"\n        -W       write output file from a separate thread"
+"\n        -D       commit output file and save checkpoint every x samples, for -A (implies -W)"
+"\n        -O out   send data also to 'out' (text file, '-' for stdout, or"
+"\n                 'tcp:port' for TCP clients); may be given several times"
+"\n        -m min   write 'outfile.<min>m' with min/mean/max/Ah every 'min' minutes;"
+"\n                 several, e.g. '1,60', give several files"
+"\n        -v Hz    refresh status line 'Hz' times per second (default 10, 0 = off)"
+"\n        -s min   save plot to 'outfile.png' every 'min' minutes ('min,svg': SVG)"
 "\n        -c txt   comment text"
 "\n        -g       specify path/to/gnuplot (if not in your current PATH)"
-"\n        -n       no graphics\n\n";
+"\n        -G       chart in terminal instead of gnuplot"
+"\n        -n       no graphics"
+"\n        -j file  run each line of 'file' (options and outfile) in turn\n\n";
 
-FILE    *outfile = NULL,
-        *gp = NULL;         /* will be a pipe to gnuplot */
-char    buffer[MAXLEN], filename[MAXLEN], comment[MAXLEN] = "", gnuplot[MAXLEN];
+FILE    *outfile = NULL;
+char    filename[MAXLEN], comment[MAXLEN] = "", gnuplot[MAXLEN], line[4*MAXLEN],
+        columns[2*MAXLEN] = "min\tVolt\tAmpere",   /* titles of data columns */
+        statename[MAXLEN+6], segname[MAXLEN+8], info[2*MAXLEN] = "",
+        binname[MAXLEN] = "", refname[MAXLEN] = "";
+struct binlog bl;           /* binary output */
+struct rails rails;         /* further supplies */
+struct derive der = { 0 };  /* derived channels */
+struct p2 quant[3];         /* quantiles of current ... */
+struct hist hist;           /* ... and its histogram */
+struct rule rules[MAXRULES];/* limits */
+struct plot *gp = &ss->gp,  /* pipe to gnuplot */
+        snap = { -1 };      /* pipe to gnuplot for snapshots */
+struct writer wr;           /* output file */
+struct sink sinks[MAXSINKS];/* additional outputs */
+char    *sink_arg[MAXSINKS];/* ... as given */
+struct tier tiers[MAXTIERS];/* summary files */
+FILE    *con = stdout;      /* console output */
+static struct trace tr;     /* data for terminal chart and snapshots */
+struct tui ui;              /* terminal chart */
+struct checkpoint cp;       /* for resuming */
 char    do_graph = 1,       /* use graphics */
         do_overwrite = 0,   /* force overwriting existing output file */
+        do_resume = 0,      /* resume interrupted run */
+        do_compress = 0,    /* compress finished segments */
+        do_async = 0,       /* write output file from a thread */
+        do_commit = 0,      /* commit output file, save checkpoint */
+        do_tui = 0,         /* chart in terminal */
+        do_bus = 0,         /* lock GPIB board for each transaction */
+        do_stamp = 0,       /* times of readings: 1 = log, 2 = and align I to V */
+        do_quant = 0,       /* quantiles and histogram of current */
+        snap_svg = 0,       /* snapshots as SVG instead of PNG */
         do_keypress = 1,    /* wait for keypress at the end */
         do_ocp = 0,         /* use overcurrent trip */
         do_reset = 1,       /* do reset after run */
         dramp = 0,          /* do dual ramp */
-        dramp_avail = 0;    /* dual ramp second dataset is available */
-int     inst, pad=5, key, do_flush = 100, delay = 10, ramp = 0;
-unsigned long loop = 0L;
-double  t0, t1;             /* timer */
-float	volt, amp, ramp_volt=0.0, set_volt=0.0, max_volt=0.0, set_limvolt=MAXVOLT, set_amp=MAXAMP;
+        dramp_avail = 0,    /* dual ramp second dataset is available */
+        do_stop = 0,        /* a limit rule ends the run */
+        do_cc = 0,          /* end ramp in current limit */
+        phase = 0,          /* -Q: 'C' for CC, 'V' for CV, 0 before first reading */
+        rotate = 0,         /* start new segment */
+        open_bin = 0,       /* open, to be closed on error: binary log, ... */
+        open_tiers = 0,     /* ... summary files ... */
+        open_kbd = 0,       /* ... and keyboard */
+        gap = 0;            /* reading follows a gap */
+int     i, j, inst, pad=5, err = 0,
+        lost = 0,           /* re-opened, but settings not yet restored */ key, do_flush = 100, delay = 10, ramp = 0,
+        probe = 0,          /* number of probe readings */
+        max_reconnect = 0,  /* reconnects before giving up */
+        fails = 0,          /* consecutive failed GPIB transactions */
+        seg_len = 0,        /* segment length, min */
+        nsinks = 0,         /* number of additional outputs open ... */
+        nsink_arg = 0,      /* ... and given */
+        ntiers = 0,         /* number of summary files */
+        nrules = 0,         /* number of limit rules */
+        status_hz = STATUS_HZ,  /* refresh rate of status line */
+        settle = 0,         /* settle time of ramp steps, ms */
+        step = 0,           /* ramp: index to setpoints ... */
+        nsteps = 0,         /* ... their number ... */
+        turn = 0,           /* ... and first one on the way back */
+        pcol = 0,           /* column of power in data file, 0 if none */
+        n_taper = 0,        /* -Q: readings below taper current in a row */
+        early = 0,          /* ramp: readings in current limit or off the reference to end it ... */
+        n_early = 0;        /* ... and so many in a row now */
+unsigned long n_fast = 0L;  /* -N: readings taken at the fastest rate */
+long    seg_size = 0L;      /* segment size, bytes */
+unsigned long loop = 0L, retries = 0L, reconnects = 0L,
+        st_n = 0L;          /* ramp steps timed */
+long long t0, tns = 0LL;    /* time base and sample time, ns */
+double  t1 = 0.0, tnext, tgap, tw, /* timer */
+        tset = 0.0,         /* ramp: last setpoint sent, ... */
+        tmeas,              /* ... reading started, ... */
+        tdone = 0.0,        /* ... and done; ... */
+        tstep,              /* ... previous one done; ... */
+        tfirst = 0.0,       /* ... first reading done */
+        st_set = 0.0, st_settle = 0.0, st_read = 0.0, st_max = 0.0, /* per step, s */
+        tstat = 0.0,        /* last refresh of status line */
+        snap_min = 0.0,     /* interval of snapshots, min */
+        tsnap = 0.0,        /* time of next snapshot */
+        charge = 0.0,       /* delivered charge, Ah */
+        ref_tol = REF_TOL,  /* -z: tolerance, mA */
+        chg_i, chg_ah = 0.0, chg_min = 0.0, /* -Q: taper current, charge and time limit */
+        t_phase = 0.0,      /* -Q: start of phase, min ... */
+        t_cc = 0.0, t_cv = 0.0, /* ... and time in CC and CV */
+        val[RULE_NVAL],     /* quantities checked by limit rules */
+        period,             /* interval to next reading, s ... */
+        period_max = 0.0,   /* ... its upper limit with -N, 0 if fixed ... */
+        adapt_dv = 0.0, adapt_di = 0.0, /* ... and change that keeps it short, mV, mA */
+        lat[4],             /* probed latency: min, median, 95 %, max */
+        tmo_ms;             /* GPIB timeout from cmd line */
+long    volt, amp,          /* readings, fixed point */
+        amp_min = MAXAMP * FIX_SCALE, amp_max = -MAXAMP * FIX_SCALE,
+        ramp_volt = 0,      /* ramp setpoint, fixed point ... */
+        *ramp_tab = NULL,   /* ... and all of them */
+        *ref = NULL,        /* -z: expected current at each setpoint */
+        cc_amp = 0,         /* -e: current limit, fixed point */
+        chg_taper = 0;      /* -Q: taper current, fixed point, 0 if off */
+long long amp_sum = 0,      /* sum of current readings */
+        ts[4] = { 0 },      /* start and end of V and I readings, ns */
+        tv, ti,             /* middle of V and I reading, ns since t0 */
+        ti_last = 0LL,      /* ... of the last I reading, 0 if none */
+        tns_q = 0LL;        /* ... and time of last reading, for the charge */
+long    amp_raw, amp_last = 0, set_last = 0,   /* current as read, last one, its setpoint */
+        volt_prev = 0, amp_prev = 0,    /* previous reading, for -N */
+        amp_q = 0,          /* previous current ... */
+        slope;              /* dV/dI, fixed point */
+char    *p, *q, *chg_end = NULL,    /* -Q: reason for end of charge */
+        plotx[MAXLEN] = "";  /* derived channel to be plotted */
+float	set_volt=0.0, max_volt=0.0, set_limvolt=MAXVOLT, set_amp=MAXAMP;
 time_t  t;
 
 /* --- set the gnuplot executable --- */
 
 sprintf (gnuplot, "%s", GNUPLOT);
 
+/* --- a reader going away must not kill us --- */
+
+signal (SIGPIPE, SIG_IGN);
+
 /* --- show the usual text --- */
 
-fprintf (stderr, disclaimer);
+if (0 == ss->runs)
+    fprintf (stderr, disclaimer);
+memset (&tr, 0, sizeof(tr));
+memset (&cp, 0, sizeof(cp));
+gpib_tmo = gpib_tmo_max = T1s;      /* nothing from the previous run */
+gpib_adapt = 0;
+gpib_srtt = gpib_rttvar = 0.0;
+if (bus_fd >= 0)
+    close (bus_fd);
+bus_fd = -1;
+bus_depth = 0;
+ss->started = 0;
+memset (&rails, 0, sizeof(rails));
+memset (&hist, 0, sizeof(hist));
+p2_init (&quant[0], 0.5);
+p2_init (&quant[1], 0.99);
+p2_init (&quant[2], 0.999);
+optind = 1;
 
 /* --- decode and read the command line --- */
 
-while ((key = GetOpt(argc, argv, "hfnkKIRu:U:i:M:a:w:t:c:g:r:")) != EOF)
+while ((key = GetOpt(argc, argv, "hfnGkKIRAZWDXHu:U:i:M:a:y:x:P:N:Q:w:t:c:g:r:d:e:z:C:T:E:S:L:B:O:m:l:v:s:")) != EOF)
     switch (key)
         {
         case 'h':                   /* help me */
@@ -197,6 +806,71 @@ while ((key = GetOpt(argc, argv, "hfnkKIRu:U:i:M:a:w:t:c:g:r:")) != EOF)
         case 'f':                   /* force overwriting of existing file */
             do_overwrite = 1;
             continue;
+        case 'A':                   /* resume interrupted run */
+            do_resume = 1;
+            continue;
+        case 'Z':                   /* compress finished segments */
+            do_compress = 1;
+            continue;
+        case 'W':                   /* writer thread */
+            do_async = 1;
+            continue;
+        case 'D':                   /* commit and checkpoint */
+            do_commit = 1;
+            continue;
+        case 'G':                   /* terminal chart instead of gnuplot */
+            do_tui = 1;
+            do_graph = 0;
+            continue;
+        case 'y':                   /* further supplies */
+            for (p = optarg, rails.n = 0; *p; )
+                {
+                if (rails.n < MAXRAILS)
+                    rails.pad[rails.n] = (int)strtol(p, &q, 10);
+                if (rails.n == MAXRAILS || q == p || (*q != ',' && *q != '\0') ||
+                    rails.pad[rails.n] < 0 || rails.pad[rails.n] > 30)
+                    {
+                    fprintf(stderr, "Error: -y takes up to %d GPIB addresses 0 ... 30, e.g. '6,7'.\n", MAXRAILS);
+                    return 1;
+                    }
+                rails.n++;
+                p = q + (*q == ',');
+                }
+            continue;
+        case 'x':                   /* times of readings */
+            if (!strcmp(optarg, "t"))
+                do_stamp = 1;
+            else if (!strcmp(optarg, "a"))
+                do_stamp = 2;
+            else
+                {
+                fprintf(stderr, "Error: -x takes 't' (times) or 'a' (times and aligned current).\n");
+                return 1;
+                }
+            continue;
+        case 'P':                   /* derived channels */
+            sscanf (optarg, "%6d", &der.n);
+            if (der.n < 2 || der.n > DERIVE_MAX)
+                {
+                fprintf(stderr, "Error: dV/dI window must be 2 ... %d readings.\n", DERIVE_MAX);
+                return 1;
+                }
+            continue;
+        case 'H':                   /* distribution of current */
+            do_quant = 1;
+            continue;
+        case 'l':                   /* limit rule */
+            if (nrules == MAXRULES)
+                {
+                fprintf(stderr, "Error: at most %d limit rules.\n", MAXRULES);
+                return 1;
+                }
+            if (0 == rule_parse(&rules[nrules++], optarg))
+                return 1;
+            continue;
+        case 'X':                   /* take turns on the GPIB board */
+            do_bus = 1;
+            continue;
         case 'n':                   /* disable graph display */
             do_graph = 0;
             continue;
@@ -217,6 +891,50 @@ while ((key = GetOpt(argc, argv, "hfnkKIRu:U:i:M:a:w:t:c:g:r:")) != EOF)
             if (strclean (optarg))    
                 strcpy (comment, optarg);
             continue;
+        case 'B':                   /* binary output file */
+            sscanf (optarg, "%80s", binname);
+            continue;
+        case 'O':                   /* additional output */
+            if (nsink_arg == MAXSINKS)
+                {
+                fprintf(stderr, "Error: at most %d additional outputs.\n", MAXSINKS);
+                return 1;
+                }
+            if (!strcmp(optarg, "-"))   /* data on stdout, the rest goes to stderr */
+                con = stderr;
+            sink_arg[nsink_arg++] = optarg; /* opened with the output file */
+            continue;
+        case 'm':                   /* summary files */
+            for (p = optarg, ntiers = 0; *p; )
+                {
+                if (ntiers == MAXTIERS || 1 != sscanf(p, "%5d", &tiers[ntiers].len) ||
+                    tiers[ntiers].len < 1 || tiers[ntiers].len > 10080)
+                    {
+                    fprintf(stderr, "Error: -m takes up to %d intervals of 1 ... 10080 min, e.g. '1,60'.\n", MAXTIERS);
+                    return 1;
+                    }
+                ntiers++;
+                p += strcspn(p, ",");
+                p += (*p == ',');
+                }
+            continue;
+        case 'v':                   /* status line refresh */
+            sscanf (optarg, "%3d", &status_hz);
+            if (status_hz < 0 || status_hz > 100)
+                {
+                fprintf(stderr, "Error: status refresh must be 0 ... 100 Hz.\n");
+                return 1;
+                }
+            continue;
+        case 's':                   /* snapshots */
+            sscanf (optarg, "%8lf", &snap_min);
+            if (snap_min <= 0.0 || snap_min > 1440.0)
+                {
+                fprintf(stderr, "Error: snapshot interval must be more than 0 ... 1440 min.\n");
+                return 1;
+                }
+            snap_svg = (NULL != strstr(optarg, ",svg"));
+            continue;
         case 'g':                   /* path to gnuplot */
             sscanf (optarg, "%80s", gnuplot);
             continue;
@@ -277,6 +995,11 @@ while ((key = GetOpt(argc, argv, "hfnkKIRu:U:i:M:a:w:t:c:g:r:")) != EOF)
                 }
             continue;
         case 't':                   /* delay between measurements/steps, in units of 100 ms */
+            if (*optarg == 'a')     /* 'auto', delay is set after probing */
+                {
+                delay = -1;
+                continue;
+                }
             sscanf (optarg, "%5d", &delay);
             if (delay < 0 || delay > 600)	/* delay == 0 is special, see below */
                 {
@@ -284,6 +1007,95 @@ while ((key = GetOpt(argc, argv, "hfnkKIRu:U:i:M:a:w:t:c:g:r:")) != EOF)
                 return 1;
                 }
             continue;
+        case 'd':                   /* settle time for ramps */
+            sscanf (optarg, "%6d", &settle);
+            if (settle < 1 || settle > 60000)
+                {
+                fprintf(stderr, "Error: settle time must be 1 ... 60000 ms.\n");
+                return 1;
+                }
+            continue;
+        case 'Q':                   /* CC-CV charge */
+            if (1 > sscanf (optarg, "%8lf,%8lf,%8lf", &chg_i, &chg_ah, &chg_min) ||
+                chg_i <= 0.0 || chg_i > MAXAMP || chg_ah < 0.0 || chg_min < 0.0)
+                {
+                fprintf(stderr, "Error: -Q takes taper current 0 ... %d A, and evtl. limits in Ah and min, e.g. '0.05,2.2,180'.\n", MAXAMP);
+                return 1;
+                }
+            chg_taper = FIX(chg_i);
+            continue;
+        case 'N':                   /* adaptive sampling */
+            if (3 != sscanf (optarg, "%8lf,%8lf,%8lf", &period_max, &adapt_dv, &adapt_di) ||
+                period_max < 0.1 || period_max > 3600.0 || adapt_dv <= 0.0 || adapt_di <= 0.0)
+                {
+                fprintf(stderr, "Error: -N takes max. interval 0.1 ... 3600 s, and changes in mV and mA, e.g. '60,10,1'.\n");
+                return 1;
+                }
+            continue;
+        case 'e':                   /* end ramp in current limit */
+            sscanf (optarg, "%5d", &early);
+            if (early < 1 || early > 1000)
+                {
+                fprintf(stderr, "Error: -e takes 1 ... 1000 readings.\n");
+                return 1;
+                }
+            do_cc = 1;
+            continue;
+        case 'z':                   /* end ramp off the reference curve */
+            sscanf (optarg, "%80[^,],%8lf", refname, &ref_tol);
+            if (ref_tol <= 0.0)
+                {
+                fprintf(stderr, "Error: tolerance of -z must be > 0 mA.\n");
+                return 1;
+                }
+            continue;
+        case 'C':                   /* probe GPIB link */
+            sscanf (optarg, "%5d", &probe);
+            if (probe < 0 || probe > 1000)
+                {
+                fprintf(stderr, "Error: probe must be 0 ... 1000 readings.\n");
+                return 1;
+                }
+            continue;
+        case 'T':                   /* GPIB timeout */
+            if (*optarg == 'a')     /* adaptive, starting at the default */
+                {
+                gpib_adapt = 1;
+                continue;
+                }
+            sscanf (optarg, "%7lf", &tmo_ms);
+            if (tmo_ms < 1.0 || tmo_ms > 100000.0)
+                {
+                fprintf(stderr, "Error: GPIB timeout must be 1 ... 100000 ms.\n");
+                return 1;
+                }
+            gpib_tmo = gpib_tmo_max = tmo_code(tmo_ms / 1000.0);
+            continue;
+        case 'E':                   /* recover from GPIB errors */
+            sscanf (optarg, "%5d", &max_reconnect);
+            if (max_reconnect < 0 || max_reconnect > 10000)
+                {
+                fprintf(stderr, "Error: re-open attempts must be 0 ... 10000.\n");
+                return 1;
+                }
+            continue;
+        case 'S':                   /* segment size */
+            sscanf (optarg, "%6ld", &seg_size);
+            if (seg_size < 1 || seg_size > 100000)
+                {
+                fprintf(stderr, "Error: segment size must be 1 ... 100000 MB.\n");
+                return 1;
+                }
+            seg_size *= 1024L * 1024L;
+            continue;
+        case 'L':                   /* segment length */
+            sscanf (optarg, "%6d", &seg_len);
+            if (seg_len < 1 || seg_len > 100000)
+                {
+                fprintf(stderr, "Error: segment length must be 1 ... 100000 min.\n");
+                return 1;
+                }
+            continue;
         case '~':                    /* invalid arg */
         default:
             fprintf (stderr, "'%s -h' for help.\n\n", argv[0]);
@@ -302,15 +1114,76 @@ if ((ramp) && (max_volt > set_limvolt))
     fprintf (stderr, "Error: Upper ramp voltage (-U) must be less than voltage limit (-M).\n");
     return 1;
     }
+
+if ((settle) && (!ramp))
+    {
+    fprintf (stderr, "Error: Settle time (-d) is for ramps (-r) only.\n");
+    return 1;
+    }
+
+for (i = 0; i < rails.n; i++)   /* -y: each supply only once */
+    for (j = -1; j < i; j++)
+        if (rails.pad[i] == (j < 0 ? pad : rails.pad[j]))
+            {
+            fprintf (stderr, "Error: GPIB address %d is given twice (-a, -y).\n", rails.pad[i]);
+            return 1;
+            }
+
+if ((do_cc || strlen(refname)) && (!ramp))
+    {
+    fprintf (stderr, "Error: Early end (-e, -z) is for ramps (-r) only.\n");
+    return 1;
+    }
+
+if ((chg_taper) && (ramp || do_ocp || set_volt <= 0.0))
+    {
+    fprintf (stderr, "Error: Charge mode (-Q) needs a voltage (-u), no ramp (-r) and no trip (-I).\n");
+    return 1;
+    }
+
+if ((period_max > 0.0) && (ramp))
+    {
+    fprintf (stderr, "Error: Adaptive sampling (-N) is not available for ramps (-r).\n");
+    return 1;
+    }
+
+/* if ramp is positive, run from set_volt to max_volt
+   if ramp is negative, run from max_volt to set_volt
+*/
+if (ramp)
+    {
+    if (NULL == (ramp_tab = ramp_table(FIX(set_volt), FIX(max_volt), ramp * (FIX_SCALE/1000),
+                                       dramp, &nsteps, &turn)))
+        return 1;
+    if (nsteps == 0)
+        {
+        fprintf (stderr, "Error: Ramp range is smaller than one step.\n");
+        return 1;
+        }
+    if (strlen(refname) && NULL == (ref = ref_table(refname, ramp_tab, nsteps)))
+        return 1;
+    if (strlen(refname) && !early)
+        early = REF_COUNT;
+    cc_amp = FIX(set_amp * CC_SHARE);
+    }
     
-/* if delay is > 0, we need at least one parameter on cmd line */
-if ((argv[optind] == NULL) && (delay > 0))
+/* automatic delay requires some probing */
+if ((delay < 0) && (probe == 0))
+    probe = PROBE_DEFAULT;
+
+/* if delay is not 0, we need at least one parameter on cmd line */
+if ((argv[optind] == NULL) && (delay != 0))
     {
     fprintf (stderr, msg, argv[0]);
     fprintf (stderr, "Please specify a data file.\n");
     return 1;
     }
 
+if (do_resume)   /* a resumed run can be resumed again */
+    do_commit = 1;
+if (do_commit)   /* fsync() and checkpoint by the writer thread */
+    do_async = 1;
+
 if (delay == 0)  /* if delay is 0, we will set instrument values and exit */
     {
     do_graph = 0;
@@ -319,9 +1192,32 @@ if (delay == 0)  /* if delay is 0, we will set instrument values and exit */
 else            /* if delay is > 0, prepare output data file */
     {
     strcpy (filename, argv[optind]);
-    if ((!access(filename, 0)) && (!do_overwrite))  /* If file exists and overwrite is NOT forced */
+    sprintf (statename, "%s.state", filename);
+    memset (&cp, 0, sizeof(cp));
+    if (do_resume && 0 == state_load(statename, &cp))
+        {
+        fprintf(stderr, "Cannot resume '%s'.\n", filename);
+        return ERR_FILE;
+        }
+    step = cp.step;
+
+    /* if segmented, data go to 'filename.000', 'filename.001' ... */
+    if (seg_size || seg_len)
+        sprintf (segname, "%s.%03d", filename, cp.segment);
+    else
+        strcpy (segname, filename);
+
+    if (do_resume)      /* check file against checkpoint, cut off the rest */
+        {
+        if (0 == log_verify(segname, &cp))
+            {
+            fprintf(stderr, "Cannot resume '%s'.\n", segname);
+            return ERR_FILE;
+            }
+        }
+    else if ((!access(segname, 0)) && (!do_overwrite))  /* If file exists and overwrite is NOT forced */
         {
-        fprintf (stderr, "\a\nFile '%s' exists - Overwrite? [Y/*] ", filename);
+        fprintf (stderr, "\a\nFile '%s' exists - Overwrite? [Y/*] ", segname);
         key = fgetc(stdin);         // read from keyboard
         switch (key)
             {
@@ -333,194 +1229,721 @@ else            /* if delay is > 0, prepare output data file */
             }
         }
 
-    if (NULL == (outfile = fopen(filename, "wt")))
+    memset (&wr, 0, sizeof(wr));
+    wr.statename = (do_commit ? statename : NULL);
+    if (NULL == (outfile = wr_open(&wr, segname, cp.offset, cp.crc, do_async)))
         {
-        fprintf(stderr, "Could not open '%s' for writing.\n", filename);
-        pclose(gp);
+        plot_close(gp);
         return ERR_FILE;
         }
 
     /* --- prepare gnuplot for action --- */
-    gp = popen(gnuplot,"w");
-    if (NULL == gp)
+    if (do_graph && gp->fd < 0 && 0 == plot_open(gp, gnuplot, 0, 1))
         {
         fprintf(stderr, "\nCannot launch gnuplot, will continue \"as is\".\n") ;
         fflush(stderr);
         do_graph = 0;    /* do NOT abort here, just continue */
         }
+    if (snap_min > 0.0 && 0 == plot_open(&snap, gnuplot, SNAP_NICE, 1))
+        {
+        fprintf(stderr, "\nCannot launch gnuplot, no snapshots will be taken.\n") ;
+        snap_min = 0.0;
+        }
 }
 
+if (snap_min > 0.0)   /* snapshots are rendered off-screen */
+    {
+    plot_printf(&snap, 0, "set terminal %s size 1024,768\n", snap_svg ? "svg" : "png");
+    plot_printf(&snap, 0, "set print '-'\n");     /* acknowledgements */
+    plot_printf(&snap, 0, "set style data lines; set title '%s'\n", filename);
+    plot_printf(&snap, 0, "set grid xt; set grid yt\n");
+    if (ramp)
+    	plot_printf(&snap, 0, "set xlabel 'V'; set ylabel 'A'\n");
+    else
+    	plot_printf(&snap, 0, "set xlabel 'min'; set ylabel 'V'; set y2label 'A'; set y2tics\n");
+    }
+
 if (do_graph)       /* set gnuplot display defaults */
     {
-    fprintf(gp, "set mouse;set mouse labels; set style data lines; set title '%s'\n", filename);
-    fprintf(gp, "set grid xt; set grid yt\n");
+    plot_printf(gp, 0, "set mouse;set mouse labels; set style data lines; set title '%s'\n", filename);
+    plot_printf(gp, 0, "set print '-'\n");        /* acknowledgements */
+    plot_printf(gp, 0, "set grid xt; set grid yt\n");
     if (ramp)	/* if ramping is desired, we plot I vs. U ... else plot U and I over time */
-    	fprintf(gp, "set xlabel 'V'; set ylabel 'A'\n");
+    	plot_printf(gp, 0, "set xlabel 'V'; set ylabel 'A'%s\n", (der.n ? "; set y2label 'Ohm'; set y2tics" : ""));
+    else
+    	plot_printf(gp, 0, "set xlabel 'min'; set ylabel 'V'; set y2label '%s'; set y2tics\n", (der.n ? "A, W" : "A"));
+    }
+
+if (do_stamp)
+    strcat (columns, "\tV start ms\tV end ms\tI start ms\tI end ms");
+if (do_stamp == 2)
+    strcat (columns, "\tAmpere read");
+if (der.n)
+    {
+    if (0 == derive_open(&der, der.n))
+        {
+        err = 1;
+        goto quit;
+        }
+    pcol = 4 + (do_stamp ? 4 : 0) + (do_stamp == 2);
+    strcat (columns, "\tWatt\tOhm\tdV/dI Ohm");
+    if (ramp)   /* dV/dI over V, else power over time */
+        sprintf (plotx, ", '' u 2:%d axis x1y2 ti 'dV/dI'", pcol + 2);
     else
-    	fprintf(gp, "set xlabel 'min'; set ylabel 'V'; set y2label 'A'; set y2tics\n");
-    fflush (gp);
+        sprintf (plotx, ", '' u 1:%d axis x1y2 ti 'Power'", pcol);
     }
 
 /* preparations are finished, now let's get it going ... */
 
-inst = hp663X_open(pad, do_reset);
-if (inst == 0)
+if (do_bus && 0 == bus_open(GPIB_BOARD_ID))
     {
-    fprintf(stderr, "Quit.\n");
-    if (gp) 
-        pclose(gp);
+    plot_close(gp);
     return ERR_INST;
     }
+bus_n = bus_waits = 0L;
+bus_wait_sum = bus_wait_max = 0.0;
 
-if (0 == hp663X_setup(inst, (ramp > 0 ? 0.0 : set_volt), set_amp, set_limvolt, do_ocp))
+if (ss->inst && ss->pad == pad)     /* job list: still open */
     {
-    fprintf(stderr, "Quit.\n");
-    if (gp) 
-        pclose(gp);
-    return ERR_INST;
+    inst = ss->inst;
+    ibtmo(inst, gpib_tmo);
+    }
+else
+    {
+    if (ss->inst)
+        hp663X_close(ss->inst, ss->reset);
+    inst = hp663X_open(pad, do_reset);
     }
+ss->inst = inst;
+ss->pad = pad;
+ss->reset = do_reset;
+if (inst == 0)
+    {
+    err = ERR_INST;
+    goto quit;
+    }
+
+if (0 == hp663X_setup(inst, (ramp && step < nsteps ? (float)ramp_tab[step] / FIX_SCALE : set_volt),
+                      set_amp, set_limvolt, do_ocp) ||
+    0 == rails_open(&rails, pad, (do_reset && 0 == ss->runs)))
+    {
+    err = ERR_INST;
+    goto quit;
+    }
+for (i = 0; i < rails.n; i++)   /* further supplies: same settings */
+    if (0 == hp663X_setup(rails.dev[i], (ramp && step < nsteps ? (float)ramp_tab[step] / FIX_SCALE : set_volt),
+                          set_amp, set_limvolt, do_ocp))
+        {
+        err = ERR_INST;
+        goto quit;
+        }
 
 if (delay == 0)
 	goto end;	/* my first 'goto' for many years ;-) */
 
-printf("\n GPIB address :  %d", pad);
-printf("\n  Output file :  %s", filename);
+/* characterise the GPIB link, evtl. choose the fastest sustainable delay */
+if (probe)
+    {
+    if (0 == hp663X_probe(inst, probe, lat))
+        {
+        err = ERR_INST;
+        goto quit;
+        }
+    if (delay < 0)
+        {
+        delay = (int)(lat[2] * PROBE_MARGIN * 10.0) + 1;
+        if (delay > 600)
+            delay = 600;
+        }
+    else if (delay/10.0 < lat[2] * PROBE_MARGIN)
+        fprintf(stderr, "\nWarning: sampling of %.1f s cannot be met, GPIB link needs %.3f s.\n",
+                delay/10.0, lat[2] * PROBE_MARGIN);
+    sprintf (info, "# Probe: %d x VOUT?/IOUT?, min %.1f, median %.1f, 95%% %.1f, max %.1f ms; sampling %.1f s\n",
+             probe, lat[0]*1000.0, lat[1]*1000.0, lat[2]*1000.0, lat[3]*1000.0, delay/10.0);
+    }
+
+fprintf(con, "\n GPIB address :  %d", pad);
+fprintf(con, "\n  Output file :  %s", filename);
 if (strlen(comment))
-	printf("\n      Comment :  %s", comment);
-printf("\nVoltage limit :  %.4f V", set_limvolt);
-printf("\nCurrent %5s :  %.4f A", do_ocp ? "trip" : "limit", set_amp);
-printf("\n     Sampling :  %.1f s", delay/10.0);
+	fprintf(con, "\n      Comment :  %s", comment);
+fprintf(con, "\nVoltage limit :  %.4f V", set_limvolt);
+fprintf(con, "\nCurrent %5s :  %.4f A", do_ocp ? "trip" : "limit", set_amp);
+if (chg_taper)
+    fprintf(con, "\n       Charge :  CC %.4f A, CV %.4f V, until %.4f A", set_amp, set_volt, (double)chg_taper / FIX_SCALE);
+fprintf(con, "\n     Sampling :  %.1f s", delay/10.0);
+if (period_max > 0.0)
+    fprintf(con, " ... %.1f s, fast on changes > %g mV or %g mA", period_max, adapt_dv, adapt_di);
+if (probe)
+    fprintf(con, "\n    GPIB link :  %.1f ms (median), %.1f ms (95 %%)", lat[1]*1000.0, lat[2]*1000.0);
+fprintf(con, "\n GPIB timeout :  %g ms%s", tmo_sec[gpib_tmo]*1000.0, gpib_adapt ? " (adaptive)" : "");
 if (ramp)
     {
-    printf("\n   Ramp start :  %.4f V", set_volt);
-    printf("\n     Ramp end :  %.4f V", max_volt);
-    printf("\n    Increment :  %d mV", ramp);
+    fprintf(con, "\n   Ramp start :  %.4f V", set_volt);
+    fprintf(con, "\n     Ramp end :  %.4f V", max_volt);
+    fprintf(con, "\n    Increment :  %d mV", ramp);
+    if (settle)
+        fprintf(con, "\n       Settle :  %d ms", settle);
     }
-printf("\n      Refresh :  %d", do_flush);
-printf("\n         Stop :  Press 'q' or ESC.\n");
-printf("\n     Count           Time      Reading\n");
-fflush(stdout);
-
-/* Get time, write file header */
-time(&t);
-fprintf(outfile, "# hp6633 " VERSION "\n");
-fprintf(outfile, "# %s\n", comment);
-fprintf(outfile, "# Start: %s", ctime(&t));
-fprintf(outfile, "# min\tVolt\tAmpere\n");
+fprintf(con, "\n      Refresh :  %d", do_flush);
+if (seg_size || seg_len)
+    {
+    fprintf(con, "\n     Segments :  ");
+    if (seg_size)
+        fprintf(con, "%ld MB ", seg_size / (1024L * 1024L));
+    if (seg_len)
+        fprintf(con, "%d min ", seg_len);
+    if (do_compress)
+        fprintf(con, "(compressed)");
+    }
+fprintf(con, "\n         Stop :  Press 'q' or ESC.\n");
+fprintf(con, "\n     Count           Time      Reading\n");
+fflush(con);
 
-/* if ramp is positive, run from set_volt to max_volt
-   if ramp is negative, run from max_volt to set_volt
-*/
-ramp_volt = (ramp > 0  ? set_volt : max_volt);
+t0 = clock_ns();
+ss->started = 1;
+tnext = timeinfo();
+if (ss->tend > 0.0)     /* job list: time since last run */
+    ss->idle += tnext - ss->tend;
 
-t0 = timeinfo();
-init_keyboard();    /* for kbhit() functionality */
+/* write file header (or just a mark if resuming,
+   the empty line interrupts the plotted line) */
+if (do_resume)
+    {
+    time(&t);
+    fprintf(outfile, "# Resume: %s\n", ctime(&t));
+    t0 = cp.t0;
+    tnext = timeinfo();
+    loop = cp.loop;
+    dramp_avail = cp.dramp_avail;
+    retries = cp.retries;
+    amp_sum = cp.amp_sum;
+    amp_min = cp.amp_min;
+    amp_max = cp.amp_max;
+    charge = cp.charge;
+    reconnects = cp.reconnects;
+    }
+else
+    {
+    cp.t0 = t0;
+    cp.seg_first = 1;
+    log_header(outfile, comment, info, columns, &cp, (seg_size || seg_len));
+    }
 
-key = 0;
-do  {
-    if (ramp)    /* != 0, i.e. if voltage ramping was desired */
-	{
-	/* exit the loop if voltage limit reached */
-	if (((ramp > 0) && (ramp_volt > max_volt)) || ((ramp < 0) && (ramp_volt < set_volt)))
-	    {
-	    if (!dramp)		/* if no dual-ramping is desired ... */
-		{
-		key = ESC; 	/* ... exit the loop here */
-	    	break;
-		}
-	    else		/* if dual-ramping was desired ... */
-		{
-		ramp = -ramp;	    /* invert ramp polarity, */
-                dramp_avail = 1;    /* set flag */
-  		dramp = 0;	/* and adjust this so that the loop will be quit next time */
+for (nsinks = 0; nsinks < nsink_arg; nsinks++)
+    if (0 == sink_open(&sinks[nsinks], sink_arg[nsinks], columns, do_resume))
+        {
+        err = ERR_FILE;
+        goto quit;
+        }
+if (strlen(binname))
+    {
+    if (0 == binlog_open(&bl, binname, t0, cp.binpos))
+        {
+        err = ERR_FILE;
+        goto quit;
+        }
+    open_bin = 1;
+    }
+if (0 == tier_open(tiers, ntiers, filename, comment, do_resume))
+    {
+    err = ERR_FILE;
+    goto quit;
+    }
+open_tiers = 1;
+init_keyboard();    /* for kbhit() functionality */
+open_kbd = 1;
+tset = timeinfo();  /* first setpoint was sent with the setup */
+period = delay/10.0;
+if (period_max < period)
+    period_max = 0.0;   /* nothing to adapt */
+if (do_tui)
+    tui_open(&ui, con);
 
-        /* and print two empty lines into file, allowing gnuplot to use 'index' */
-		fprintf(outfile, "\n\n");
-		}
-	    }
-	ramp_volt += ramp*0.001; /* note: ramp is given in mV */
-	if (0 == hp663X_set(inst, "VSET", ramp_volt))
+key = 0;
+do  {
+    if (ramp)    /* != 0, i.e. if voltage ramping was desired */
+	{
+	if (step == nsteps)	/* end of the ramp: exit the loop here */
+	    break;
+	if (turn && step >= turn && !dramp_avail)   /* on the way back of a dual ramp ... */
 	    {
-	    fprintf(stderr, "Quit.\n");
-	    if (gp) 
-                pclose(gp);
-	    fclose (outfile);
-	    close_keyboard();
-	    return ERR_INST;
+	    dramp_avail = 1;    /* set flag */
+
+        /* and print two empty lines into file, allowing gnuplot to use 'index' */
+	    fprintf(outfile, "\n\n");
 	    }
+	ramp_volt = ramp_tab[step];	/* was sent after the last reading */
 	}
 
-    usleep (delay * 100000); 	/* wait (delay * 0.1) s */
-    t1 = (timeinfo()-t0)/60.0;  /* get actual time */
+    /* wait for the next point of the time grid, i.e. (delay * 0.1) s
+       (or the adapted interval) after the previous one, so that GPIB
+       time does not add up; or, for a ramp with settle time, just
+       until it has settled */
+    if (settle)
+        tnext = tset + settle/1000.0;
+    else
+        tnext += period;
+    tw = timeinfo();
+    if (tnext <= tw)
+        tnext = tw;             /* late: restart grid, do not catch up */
+    while (tnext > tw)          /* in slices, to stay responsive to 'q' */
+        {
+        usleep ((useconds_t)((tnext - tw > 0.1 ? 0.1 : tnext - tw) * 1000000.0));
+        if (kbhit() && ((key = readch()) == 'q' || key == ESC))
+            break;
+        tw = timeinfo();
+        }
+    if ((key == 'q') || (key == ESC))
+        break;
+    tns = clock_ns() - t0;      /* get actual time */
+    t1 = tns / 6e10;
+
+    /* read 'real' output voltage and output current, evtl. retry */
+    tmeas = timeinfo();
+    while (lost || 0 == hp663X_measure(inst, &volt, &amp, ts))
+        {
+        if (fails++ == 0)
+            tgap = t1;
+        if (fails > RETRY_MAX) reconnects++; else retries++;
+        if (0 == (lost = hp663X_recover(&inst, &rails, pad, fails, max_reconnect,
+                                        (ramp ? (float)ramp_volt / FIX_SCALE : set_volt),
+                                        set_amp, set_limvolt, do_ocp)))
+            {
+            err = ERR_INST;
+            goto quit;
+            }
+        lost = (lost < 0);
+        tns = clock_ns() - t0;
+        t1 = tns / 6e10;
+        }
+
+    /* after trouble, mark the gap in the file (the empty line
+       interrupts the plotted line, but keeps the gnuplot index) */
+    if (fails)
+        {
+        fprintf(outfile, "# Gap: %.4f ... %.4f min, %d failed attempts\n\n", tgap, t1, fails);
+        fails = 0;
+        tnext = timeinfo();     /* restart time grid */
+        ti_last = 0LL;          /* do not interpolate across the gap ... */
+        tns_q = 0LL;            /* ... nor count charge over it */
+        gap = 1;
+        }
+
+    /* voltage and current are read one after the other; if asked for,
+       estimate the current at the middle of the voltage reading from
+       this and the last current reading (at the same setpoint only) */
+    tv = (ts[0] + ts[1]) / 2 - t0;
+    ti = (ts[2] + ts[3]) / 2 - t0;
+    amp_raw = amp;
+    if (do_stamp == 2)
+        {
+        if (ti_last && ramp_volt == set_last && ti_last < tv && tv < ti)
+            amp = amp_last + (long)((long long)(amp - amp_last) * (tv - ti_last) / (ti - ti_last));
+        tns = tv;               /* V and I now belong to this moment */
+        t1 = tns / 6e10;
+        }
+    amp_last = amp_raw;
+    ti_last = ti;
+    set_last = ramp_volt;
+
+    /* adaptive sampling: back to full speed as soon as something
+       happens, and slow down step by step while nothing does */
+    if (period_max > 0.0)
+        {
+        if (loop == 0 || labs(volt - volt_prev) > adapt_dv * (FIX_SCALE/1000) ||
+            labs(amp - amp_prev) > adapt_di * (FIX_SCALE/1000))
+            period = delay/10.0;
+        else if ((period *= ADAPT_GROW) > period_max)
+            period = period_max;
+        if (period == delay/10.0)
+            n_fast++;
+        volt_prev = volt;
+        amp_prev = amp;
+        }
+
+    /* ramp: send the next setpoint right away, the file
+       is written and the display updated while it settles */
+    if (ramp)
+        {
+        tstep = tdone;          /* previous reading done */
+        tdone = timeinfo();
+        st_settle += tmeas - tset;
+        st_read += tdone - tmeas;
+        if (st_n++ == 0)
+            tfirst = tdone;
+        else if (tdone - tstep > st_max)
+            st_max = tdone - tstep;
+
+        /* in current limit, or off the reference curve, for some
+           readings in a row: the rest of the way out is of no use,
+           so turn back now (dual ramp) or end here */
+        if (early && (!turn || step < turn))
+            {
+            if ((do_cc && amp >= cc_amp && volt < ramp_volt - CC_DROP) ||
+                (ref && ref[step] != REF_NONE && labs(amp - ref[step]) > ref_tol * (FIX_SCALE/1000)))
+                n_early++;
+            else
+                n_early = 0;
+            if (n_early >= early)
+                {
+                fprintf(con, "\n%s at %.4f V, ramp %s.\n",
+                        ((do_cc && amp >= cc_amp) ? "Current limit" : "Off reference"), (double)ramp_volt / FIX_SCALE,
+                        (turn ? "turns" : "ends"));
+                fprintf(outfile, "# Early: %s at %.4f V, ramp %s\n",
+                        ((do_cc && amp >= cc_amp) ? "current limit" : "off reference"), (double)ramp_volt / FIX_SCALE,
+                        (turn ? "turns" : "ends"));
+                step = (turn ? 2 * turn - 2 - step : nsteps - 1);
+                n_early = 0;
+                }
+            }
+        if (++step < nsteps)
+            {
+            while (lost || 0 == rails_set(&rails, inst, "VSET", ramp_tab[step]))
+                {
+                if (fails++ == 0)
+                    tgap = (clock_ns() - t0) / 6e10;
+                if (fails > RETRY_MAX) reconnects++; else retries++;
+                if (0 == (lost = hp663X_recover(&inst, &rails, pad, fails, max_reconnect,
+                                                (float)ramp_tab[step] / FIX_SCALE,
+                                                set_amp, set_limvolt, do_ocp)))
+                    {
+                    err = ERR_INST;
+                    goto quit;
+                    }
+                lost = (lost < 0);
+                }
+            tset = timeinfo();
+            st_set += tset - tdone;
+            }
+        }
+
+    /* update statistics */
+    loop++;
+    amp_sum += amp;
+    if (amp < amp_min)
+        amp_min = amp;
+    if (amp > amp_max)
+        amp_max = amp;
+    if (tns_q)              /* not across a gap or resume */
+        charge += (double)(amp_q + amp) / 2 / FIX_SCALE * (tns - tns_q) / 3.6e12;
+    tns_q = tns;
+    amp_q = amp;
+    if (do_quant)
+        {
+        for (i = 0; i < 3; i++)
+            p2_add(&quant[i], amp);
+        hist_add(&hist, amp);
+        }
+
+    /* charge mode: the supply itself goes from CC to CV as the
+       voltage comes up to -u; note when it does, and end the charge
+       when the current has tapered off, or on charge or time limit */
+    if (chg_taper)
+        {
+        if (phase != ((volt < FIX(set_volt) - CC_DROP) ? 'C' : 'V'))
+            {
+            if (phase == 'C')
+                t_cc += t1 - t_phase;
+            if (phase == 'V')
+                t_cv += t1 - t_phase;
+            phase = ((volt < FIX(set_volt) - CC_DROP) ? 'C' : 'V');
+            t_phase = t1;
+            n_taper = 0;
+            fprintf(outfile, "# Phase: C%c at %.4f min, %.6f Ah\n", phase, t1, charge);
+            }
+        if (phase == 'V' && amp < chg_taper)
+            n_taper++;
+        else
+            n_taper = 0;
+        if (n_taper >= CHG_COUNT)
+            chg_end = "taper current";
+        else if (chg_ah > 0.0 && charge >= chg_ah)
+            chg_end = "charge limit";
+        else if (chg_min > 0.0 && t1 >= chg_min)
+            chg_end = "time limit";
+        if (chg_end)
+            {
+            bus_wrt(inst, "OUT 0\n");
+            for (j = 0; j < rails.n; j++)
+                bus_wrt(rails.dev[j], "OUT 0\n");
+            do_stop = 1;
+            }
+        }
 
-    /* read 'real' output voltage */
-    if (0 == (hp663X_read(inst, "VOUT?", buffer)))
+    /* show data to screen, but not more often than needed */
+    if (do_tui || snap_min > 0.0)
+        trace_add(&tr, t1, (float)volt / FIX_SCALE, (float)amp / FIX_SCALE);
+    if (do_tui)
+        tui_draw(&ui, &tr, (ramp != 0));
+    if (snap_min > 0.0 && t1 >= tsnap)
+        {
+        snapshot(&snap, &tr, filename, snap_svg, (ramp != 0), 0);
+        tsnap = t1 + snap_min;
+        }
+    if (status_hz && (timeinfo() - tstat) * status_hz >= 1.0)
         {
-        fprintf(stderr, "Quit.\n");
-        if(gp)
-	    pclose(gp);
-	fclose (outfile);
-        close_keyboard();
-        return ERR_INST;
+        fprintf(con, "%10lu %10.2f min %10.4f V %10.4f A %10.4f A avg", loop, t1,
+                (double)volt / FIX_SCALE, (double)amp / FIX_SCALE, (double)amp_sum / loop / FIX_SCALE);
+        if (do_quant)
+            fprintf(con, " %.4f/%.4f/%.4f A", p2_get(&quant[0]) / FIX_SCALE,
+                    p2_get(&quant[1]) / FIX_SCALE, p2_get(&quant[2]) / FIX_SCALE);
+        if (chg_taper)
+            fprintf(con, " %s %.4f Ah", (phase == 'V' ? "CV" : "CC"), charge);
+        fprintf(con, "\r");
+        fflush (con);
+        tstat = timeinfo();
         }
-    sscanf (buffer, "%f", &volt);
 
-    /* read output current */
-    if (0 == (hp663X_read(inst, "IOUT?", buffer)))
+    /* write data to file(s) */
+    p = fix_put(line, (tns + NS_TICK/2) / NS_TICK);
+    *p++ = '\t';
+    p = fix_put(p, volt);
+    *p++ = '\t';
+    p = fix_put(p, amp);
+    if (do_stamp)           /* start and end of readings, ms (0.1 us) */
+        for (i = 0; i < 4; i++)
+            {
+            *p++ = '\t';
+            p = fix_put(p, (ts[i] - t0 - tns) / 100);
+            }
+    if (do_stamp == 2)
+        {
+        *p++ = '\t';
+        p = fix_put(p, amp_raw);
+        }
+    if (der.n)              /* derived channels, "NaN" if undefined */
+        {
+        *p++ = '\t';
+        p = fix_put(p, llround((double)volt * amp / FIX_SCALE));
+        *p++ = '\t';
+        p = (amp ? fix_put(p, llround((double)volt * FIX_SCALE / amp)) : stpcpy(p, "NaN"));
+        *p++ = '\t';
+        p = (derive_add(&der, volt, amp, &slope) ? fix_put(p, slope) : stpcpy(p, "NaN"));
+        }
+    *p++ = '\n';
+    *p = '\0';
+    fputs (line, outfile);
+    sink_put(sinks, nsinks, line);
+    tier_add(tiers, ntiers, tns, volt, amp, gap);
+    gap = 0;
+    if (strlen(binname) && 0 == binlog_write(&bl, tns, volt, amp))
         {
-        fprintf(stderr, "Quit.\n");
-        if (gp)
-            pclose(gp);
-	fclose (outfile);
-        close_keyboard();
-        return ERR_INST;
+        err = ERR_FILE;
+        goto quit;
         }
-    sscanf (buffer, "%f", &amp);
 
-    /* show data to screen and write them to file */
-    printf("%10lu %10.2f min %10.4f V %10.4f A\r", ++loop, t1, volt, amp);
-    fprintf(outfile, "%.4f\t%.4f\t%.4f\n", t1, volt, amp);
-    fflush (stdout);
+    /* start a new segment if this one is big or old enough */
+    rotate = (seg_size && wr.pos >= seg_size) ||
+             (seg_len && (t0 + tns) / (seg_len * 60000000000LL) !=
+                         (t0 + (long long)(cp.seg_t * 6e10)) / (seg_len * 60000000000LL));
 
     /* ensure write & display at least every x data points */
-    if (!(loop % do_flush))
+    if (rotate || !(loop % do_flush))
         {
-        fflush (outfile);
+        /* commit data to disk and save the checkpoint */
+        cp.loop = loop;
+        cp.step = step;
+        cp.dramp_avail = dramp_avail;
+        cp.retries = retries;
+        cp.reconnects = reconnects;
+        cp.amp_sum = amp_sum;
+        cp.amp_min = amp_min;
+        cp.amp_max = amp_max;
+        cp.charge = charge;
+        if (strlen(binname))
+            cp.binpos = bl.pos;
+        if (rotate)
+            {
+            if (NULL == (outfile = log_segment(outfile, &wr, filename, segname, &cp, t1, do_compress)))
+                {
+                err = ERR_FILE;
+                goto quit;
+                }
+            log_header(outfile, comment, info, columns, &cp, 1);
+            }
+        if (0 == log_commit(outfile, &wr, &cp))
+            fprintf(stderr, "\nWarning: could not commit data to '%s'.\n", segname);
+        sink_flush(sinks, nsinks);
+        tier_flush(tiers, ntiers);
         if (do_graph)
             {
     	    if (ramp)	/* if ramping is desired, we plot I vs. U ... else plot U and I over time */
                 {
 		        if (dramp_avail)
-                    fprintf(gp, "plot '%s' using 2:3 index 0 ti 'I vs. U (1)', '' u 2:3 index 1 ti 'I vs. U (2)'\n", filename);      
+                    plot_printf(gp, 1, "plot '%s' using 2:3 index 0 ti 'I vs. U (1)', '' u 2:3 index 1 ti 'I vs. U (2)'%s\n", segname, plotx);      
                 else    
-                    fprintf(gp, "plot '%s' using 2:3 ti 'I vs. U (1)'\n", filename);
+                    plot_printf(gp, 1, "plot '%s' using 2:3 ti 'I vs. U (1)'%s\n", segname, plotx);
                 }    
 	        else
-	            fprintf(gp, "plot '%s' using 1:2 title 'Voltage', '' u 1:3 axis x1y2 title 'Current'\n", filename);
-            fflush (gp);
+	            plot_printf(gp, 1, "plot '%s' using 1:2 title 'Voltage', '' u 1:3 axis x1y2 title 'Current'%s\n", segname, plotx);
             }
         }
 
+    /* check limits; the first violation decides the verdict, and
+       the action of each rule is taken when it is first violated */
+    if (nrules)
+        {
+        val[0] = (double)volt / FIX_SCALE;
+        val[1] = (double)amp / FIX_SCALE;
+        val[2] = val[0] * val[1];
+        val[3] = (double)amp_sum / loop / FIX_SCALE;
+        val[4] = charge;
+        for (i = 0; i < nrules; i++)
+            if (rule_check(&rules[i], val) && rules[i].hits++ == 0)
+                {
+                fprintf(con, "\nLimit '%s' violated at %.4f min.\n", rules[i].text, t1);
+                fprintf(outfile, "# Limit: '%s' violated at %.4f min\n", rules[i].text, t1);
+                if (!cp.violated)
+                    {
+                    cp.violated = 1;
+                    strcpy (cp.rule, rules[i].text);
+                    cp.t_violated = t1;
+                    }
+                if (rules[i].action == RULE_OFF)
+                    {
+                    bus_wrt(inst, "OUT 0\n");
+                    for (j = 0; j < rails.n; j++)
+                        bus_wrt(rails.dev[j], "OUT 0\n");
+                    }
+                if (rules[i].action == RULE_STOP)
+                    do_stop = 1;
+                }
+        }
+
     /* look up keyboard for keypress */
     if(kbhit())
         key = readch();
     }
-    while ((key != 'q') && (key != ESC));
+    while ((key != 'q') && (key != ESC) && !do_stop);
+ss->abort = ((key == 'q') || (key == ESC));
 
+if (do_tui)
+    tui_close(&ui);
+if (status_hz)      /* show last reading */
+    fprintf(con, "%10lu %10.2f min %10.4f V %10.4f A %10.4f A avg", loop, t1,
+            (double)volt / FIX_SCALE, (double)amp / FIX_SCALE, (loop ? (double)amp_sum / loop / FIX_SCALE : 0.0));
+if (loop)
+    {
+    fprintf(con, "\n\nCurrent: min %.4f A, mean %.4f A, max %.4f A.", (double)amp_min / FIX_SCALE,
+            (double)amp_sum / loop / FIX_SCALE, (double)amp_max / FIX_SCALE);
+    fprintf(outfile, "# Current: min %.4f, mean %.4f, max %.4f A\n", (double)amp_min / FIX_SCALE,
+            (double)amp_sum / loop / FIX_SCALE, (double)amp_max / FIX_SCALE);
+    if (!chg_taper)     /* else with the CC-CV summary below */
+        fprintf(con, "\nCharge: %.6f Ah.", charge);
+    fprintf(outfile, "# Charge: %.6f Ah\n", charge);
+    }
+if (chg_taper && loop)
+    {
+    if (phase == 'C')
+        t_cc += t1 - t_phase;
+    if (phase == 'V')
+        t_cv += t1 - t_phase;
+    fprintf(con, "\n\nCharge: %.6f Ah, CC %.2f min, CV %.2f min, %s.", charge, t_cc, t_cv,
+            (chg_end ? chg_end : "stopped by user"));
+    fprintf(outfile, "# CC-CV: %.6f Ah, CC %.4f min, CV %.4f min, end: %s\n", charge, t_cc, t_cv,
+            (chg_end ? chg_end : "stopped by user"));
+    }
+if (cp.violated)
+    {
+    fprintf(con, "\n\nVerdict: FAIL, '%s' at %.4f min%s.", cp.rule, cp.t_violated,
+            (do_stop ? ", run stopped" : ""));
+    fprintf(outfile, "# Verdict: FAIL, '%s' at %.4f min%s\n", cp.rule, cp.t_violated,
+            (do_stop ? ", run stopped" : ""));
+    }
+else if (nrules)
+    {
+    fprintf(con, "\n\nVerdict: PASS, %d limits kept.", nrules);
+    fprintf(outfile, "# Verdict: PASS, %d limits kept\n", nrules);
+    }
+if (loop && do_quant)
+    {
+    fprintf(con, "\n\nCurrent: median %.4f A, 99 %% %.4f A, 99.9 %% %.4f A.", p2_get(&quant[0]) / FIX_SCALE,
+            p2_get(&quant[1]) / FIX_SCALE, p2_get(&quant[2]) / FIX_SCALE);
+    fprintf(outfile, "# Quantiles: median %.4f, 99 %% %.4f, 99.9 %% %.4f A\n", p2_get(&quant[0]) / FIX_SCALE,
+            p2_get(&quant[1]) / FIX_SCALE, p2_get(&quant[2]) / FIX_SCALE);
+    hist_print(&hist, con, outfile);
+    }
+if (retries || reconnects)
+    {
+    fprintf(con, "\n\n%lu retries, %lu reconnects.", retries, reconnects);
+    fprintf(outfile, "# Retries: %lu, reconnects: %lu\n", retries, reconnects);
+    }
+if (rails.n && rails.updates)
+    {
+    fprintf(con, "\n\nRails: %lu setpoints %s, skew %.2f ms average, %.2f ms max.",
+            rails.updates, (rails.group ? "sent to all at once" : "sent one by one"),
+            rails.skew_sum * 1000.0 / rails.updates, rails.skew_max * 1000.0);
+    fprintf(outfile, "# Rails: %lu setpoints %s, skew %.2f ms average, %.2f ms max\n",
+            rails.updates, (rails.group ? "sent to all at once" : "sent one by one"),
+            rails.skew_sum * 1000.0 / rails.updates, rails.skew_max * 1000.0);
+    }
+if (do_bus)
+    {
+    fprintf(con, "\n\nGPIB board: %lu transactions, %lu waited for others, %.1f ms average, %.1f ms max.",
+            bus_n, bus_waits, (bus_waits ? bus_wait_sum * 1000.0 / bus_waits : 0.0), bus_wait_max * 1000.0);
+    fprintf(outfile, "# Bus: %lu transactions, %lu waited, %.1f ms average, %.1f ms max\n",
+            bus_n, bus_waits, (bus_waits ? bus_wait_sum * 1000.0 / bus_waits : 0.0), bus_wait_max * 1000.0);
+    }
+if (period_max > 0.0 && loop)
+    {
+    fprintf(con, "\n\nAdaptive sampling: %lu readings, %.1f %% at %.1f s, %.2f s average.",
+            loop, 100.0 * n_fast / loop, delay/10.0, t1 * 60.0 / loop);
+    fprintf(outfile, "# Adaptive: %lu readings, %.1f %% at %.1f s, %.2f s average\n",
+            loop, 100.0 * n_fast / loop, delay/10.0, t1 * 60.0 / loop);
+    }
+if (st_n > 1)
+    {
+    fprintf(con, "\n\nSteps: %lu, %.1f ms per step (VSET %.1f, settle %.1f, reading %.1f ms), max %.1f ms.",
+            st_n, (tdone - tfirst) * 1000.0 / (st_n - 1), st_set * 1000.0 / st_n,
+            st_settle * 1000.0 / st_n, st_read * 1000.0 / st_n, st_max * 1000.0);
+    fprintf(outfile, "# Steps: %lu, %.1f ms per step (VSET %.1f, settle %.1f, reading %.1f ms), max %.1f ms\n",
+            st_n, (tdone - tfirst) * 1000.0 / (st_n - 1), st_set * 1000.0 / st_n,
+            st_settle * 1000.0 / st_n, st_read * 1000.0 / st_n, st_max * 1000.0);
+    }
+if (do_async)
+    {
+    fprintf(con, "\n\nWriter: %lu buffers, max. %d waiting, %lu stalls, %.1f ms average, %.1f ms max.",
+           wr.writes, wr.maxqueue, wr.stalls,
+           (wr.writes ? wr.lat_sum * 1000.0 / wr.writes : 0.0), wr.lat_max * 1000.0);
+    fprintf(outfile, "# Writer: %lu buffers, max. %d waiting, %lu stalls, %.1f ms average, %.1f ms max\n",
+           wr.writes, wr.maxqueue, wr.stalls,
+           (wr.writes ? wr.lat_sum * 1000.0 / wr.writes : 0.0), wr.lat_max * 1000.0);
+    }
+if (do_graph && gp->skipped)
+    fprintf(con, "\n\ngnuplot was busy, %lu plot refreshes skipped.", gp->skipped);
+if (snap_min > 0.0)     /* last one, with all data */
+    {
+    snapshot(&snap, &tr, filename, snap_svg, (ramp != 0), 1);
+    plot_close(&snap);
+    if (snap.skipped)
+        fprintf(con, "\n\ngnuplot was busy, %lu snapshots skipped.", snap.skipped);
+    }
 time(&t);
 fprintf(outfile, "# Stop: %s\n", ctime(&t));
-fclose (outfile);
+if (fclose (outfile))
+    fprintf(stderr, "\nError writing to '%s'.\n", segname);
+outfile = NULL;
+if (open_bin && 0 == binlog_close(&bl))
+    fprintf(stderr, "\nError writing to '%s'.\n", binname);
+sink_close(sinks, nsinks);
+tier_close(tiers, ntiers);
+open_bin = open_tiers = nsinks = 0;
+if (seg_size || seg_len)    /* list last segment (left uncompressed for the plot) */
+    log_list(filename, segname, &cp, loop, t1);
+remove (statename);     /* run is complete, nothing to resume */
 
 end:
+ss->tend = timeinfo();
 
-/* terminate, evtl. send reset to instrument */
-if (! hp663X_close(inst, do_reset))
+/* terminate, evtl. send reset to instrument; in a job list,
+   only after the last run */
+rails_close(&rails, (do_reset && ss->last));
+if (ss->last)
+    ss->inst = 0;
+if (ss->last && ! hp663X_close(inst, do_reset))
     {
-    fprintf(stderr, "Quit.\n");
-    if (gp) 
-        pclose(gp);
-    close_keyboard();
-    return ERR_INST;
+    err = ERR_INST;
+    goto quit;
     }
 
 if (do_graph)   /* if graphic display was used, replot of data (using same cmd as above) */
@@ -528,26 +1951,274 @@ if (do_graph)   /* if graphic display was used, replot of data (using same cmd a
     if (ramp)   /* if ramping is desired, we plot I vs. U ... else plot U and I over time */
         {
 		if (dramp_avail)
-            fprintf(gp, "plot '%s' using 2:3 index 0 ti 'I vs. U (1)', '' u 2:3 index 1 ti 'I vs. U (2)'\n", filename);      
+            plot_printf(gp, 0, "plot '%s' using 2:3 index 0 ti 'I vs. U (1)', '' u 2:3 index 1 ti 'I vs. U (2)'%s\n", segname, plotx);      
         else    
-            fprintf(gp, "plot '%s' using 2:3 ti 'I vs. U (1)'\n", filename);
+            plot_printf(gp, 0, "plot '%s' using 2:3 ti 'I vs. U (1)'%s\n", segname, plotx);
         }    
     else
-        fprintf(gp, "plot '%s' using 1:2 title 'Voltage', '' u 1:3 axis x1y2 title 'Current'\n", filename);
-    fflush (gp);
+        plot_printf(gp, 0, "plot '%s' using 1:2 title 'Voltage', '' u 1:3 axis x1y2 title 'Current'%s\n", segname, plotx);
 
-    if (do_keypress)    /* wait for user input */
+    if (do_keypress && ss->last)    /* wait for user input */
         {
-        printf("\nAcquisition finished. Press any key to terminate graphic display and exit.\n");
+        fprintf(con, "\nAcquisition finished. Press any key to terminate graphic display and exit.\n");
         while (!kbhit())
             usleep (100000); 	/* wait 0.1 s */
         }
-    pclose(gp);
     }
 
 close_keyboard();
-printf("\n");
-return 0;
+free (ramp_tab);
+free (ref);
+derive_close(&der);
+fprintf(con, "\n");
+return (cp.violated ? ERR_LIMIT : 0);
+
+/* error: close what is open, in reverse order; the instrument
+   is left to the caller */
+quit:
+fprintf(stderr, "Quit.\n");
+if (ss->inst)               /* may have been re-opened */
+    ss->inst = inst;
+if (open_kbd)
+    close_keyboard();
+if (open_tiers)
+    tier_close(tiers, ntiers);
+if (open_bin)
+    binlog_close(&bl);
+sink_close(sinks, nsinks);
+rails_close(&rails, do_reset);
+derive_close(&der);
+plot_close(&snap);
+plot_close(gp);
+if (outfile)
+    fclose (outfile);
+free (ramp_tab);
+free (ref);
+return err;
+}
+
+
+/********************************************************
+* main:       runs hp6633_run() once, or for each line  *
+*             of a job list (-j), on one open device    *
+*             and one gnuplot.                          *
+* Input:      see hp6633_run().                         *
+* Return:     0 if OK, else error code                  *
+********************************************************/
+int main (int argc, char *argv[])
+{
+struct session ss;
+FILE    *f;
+char    *jobname = NULL, **jobs = NULL, buf[JOB_LEN], *av[JOB_ARGS];
+int     i, k, n, ac, base, njobs = 0, err = 0;
+
+memset (&ss, 0, sizeof(ss));
+ss.gp.fd = -1;
+
+/* '-j file' is taken out, the rest is given to each job */
+for (i = k = 1; i < argc; i++)
+    if (!strcmp(argv[i], "-j") && i + 1 < argc)
+        jobname = argv[++i];
+    else if (k < JOB_ARGS / 2)
+        av[k++] = argv[i];
+av[0] = argv[0];
+base = k;
+
+if (NULL == jobname)            /* just one run */
+    {
+    ss.last = 1;
+    err = hp6633_run(argc, argv, &ss);
+    plot_close(&ss.gp);
+    return err;
+    }
+
+if (NULL == (f = fopen(jobname, "rt")))
+    {
+    fprintf(stderr, "Could not open '%s' for reading.\n", jobname);
+    return ERR_FILE;
+    }
+while (fgets(buf, JOB_LEN, f))
+    {
+    buf[strcspn(buf, "\r\n")] = '\0';
+    if (buf[strspn(buf, " \t")] == '\0' || buf[strspn(buf, " \t")] == '#')
+        continue;               /* empty line or comment */
+    if (NULL == (jobs = realloc(jobs, (njobs + 1) * sizeof(char *))) ||
+        NULL == (jobs[njobs++] = strdup(buf)))
+        {
+        fprintf(stderr, "Out of memory!\n");
+        fclose (f);
+        return ERR_FILE;
+        }
+    }
+fclose (f);
+
+for (i = 0; i < njobs && !err && !ss.abort; i++)
+    {
+    fprintf(stderr, "\n--- Job %d of %d: %s\n", i + 1, njobs, jobs[i]);
+    n = job_split(jobs[i], av + base, JOB_ARGS - base - 1);
+    ac = base + n;
+    av[ac] = NULL;
+    ss.last = (i == njobs - 1);
+    err = hp6633_run(ac, av, &ss);
+    ss.runs++;
+    if (!err || ss.started)     /* e.g. a failed limit: still done */
+        ss.done++;
+    }
+
+fprintf(stderr, "\nJob list '%s': %d of %d runs done, %.2f s idle between runs.\n",
+        jobname, ss.done, njobs, ss.idle);
+if (ss.inst && !ss.last)        /* stopped early: switch off, unless -k */
+    hp663X_close(ss.inst, ss.reset);
+plot_close(&ss.gp);
+for (i = 0; i < njobs; i++)
+    free (jobs[i]);
+free (jobs);
+return err;
+}
+
+
+/********************************************************
+* job_split: Splits a line of the job list into words,  *
+*           like the shell would ("..." keeps spaces).  *
+*           The line is modified.                       *
+* Input:    - line                                      *
+*           - array for ptrs to the words, its size     *
+* Return:   number of words                             *
+********************************************************/
+int job_split (char *line, char *av[], const int max)
+{
+char    *p = line, *q;
+int     n = 0;
+
+while (n < max)
+    {
+    while (*p == ' ' || *p == '\t')
+        p++;
+    if (*p == '\0')
+        break;
+    av[n++] = q = p;
+    while (*p && *p != ' ' && *p != '\t')
+        {
+        if (*p == '"')          /* quoted: copy up to the closing quote */
+            {
+            for (p++; *p && *p != '"'; )
+                *q++ = *p++;
+            if (*p)
+                p++;
+            }
+        else
+            *q++ = *p++;
+        }
+    if (*p)
+        p++;
+    *q = '\0';
+    }
+return n;
+}
+
+
+/********************************************************
+* rails_open: Opens further supplies that follow the    *
+*           setpoints of the main one.                  *
+* Input:    - ptr to rails (pad[] and n filled in)      *
+*           - GPIB address of the main supply           *
+*           - flag if devices should be cleared         *
+* Return:   1 if OK, 0 if error                         *
+********************************************************/
+int rails_open (struct rails *r, const int pad, const char do_reset)
+{
+int     i;
+
+r->list[0] = MakeAddr(pad, 0);
+for (i = 0; i < r->n; i++)
+    {
+    if (0 == (r->dev[i] = hp663X_open(r->pad[i], do_reset)))
+        return 0;
+    r->list[i+1] = MakeAddr(r->pad[i], 0);
+    }
+r->list[r->n+1] = NOADDR;
+r->group = 1;               /* until proven otherwise */
+r->updates = 0L;
+r->skew_sum = r->skew_max = 0.0;
+return 1;
+}
+
+
+/********************************************************
+* rails_set: Sets one parameter on the main supply and  *
+*           all rails at once. All supplies are made    *
+*           listeners and get one message (SendList()), *
+*           so they all take it at the same moment. If  *
+*           that fails, they are written one after the  *
+*           other as fast as possible, and the time     *
+*           from first to last is kept as skew.         *
+* Input:    - ptr to rails                              *
+*           - file ptr of main supply (hp663X_open())   *
+*           - instruction ("VSET", ...)                 *
+*           - value for instruction, fixed point        *
+* Return:   1 if OK, 0 if error                         *
+********************************************************/
+int rails_set (struct rails *r, const int inst, const char cmd[], const long val)
+{
+static char buf[MAXLEN];
+double  t;
+int     i, ok;
+
+if (r->n == 0)
+    return hp663X_set(inst, cmd, val);
+
+strcat (fix_put(buf + sprintf(buf, "%s ", cmd), val), "\n");
+if (r->group)
+    {
+    bus_lock();
+    SendList(GPIB_BOARD_ID, r->list, buf, strlen(buf), DABend);
+    bus_unlock();
+    if (!(ibsta & ERR))
+        {
+        r->updates++;       /* no skew: it is one message */
+        return 1;
+        }
+    fprintf(stderr, "Group write failed, setting supplies one by one from now on.\n");
+    r->group = 0;
+    }
+
+bus_lock();                 /* burst: nobody else in between */
+ok = !(ibwrt(inst, buf, strlen(buf)) & ERR);
+t = timeinfo();
+for (i = 0; i < r->n; i++)
+    ok &= !(ibwrt(r->dev[i], buf, strlen(buf)) & ERR);
+t = timeinfo() - t;
+bus_unlock();
+if (!ok)
+    {
+    fprintf(stderr, "Error executing '%s'!\n", buf);
+    return 0;
+    }
+r->updates++;
+r->skew_sum += t;
+if (t > r->skew_max)
+    r->skew_max = t;
+return 1;
+}
+
+
+/********************************************************
+* rails_close: Resets (if requested) and closes rails.  *
+* Input:    - ptr to rails                              *
+*           - flag if devices should be reset           *
+* Return:   Nothing.                                    *
+********************************************************/
+void rails_close (struct rails *r, const char do_reset)
+{
+int     i;
+
+for (i = 0; i < r->n; i++)
+    if (r->dev[i])
+        {
+        hp663X_close(r->dev[i], do_reset);
+        ibonl(r->dev[i], 0);
+        r->dev[i] = 0;
+        }
 }
 
 
@@ -562,7 +2233,8 @@ int hp663X_open (const int pad, const char do_reset)
 int inst;
 static char buf[MAXLEN];
 
-inst = ibdev(GPIB_BOARD_ID, pad, 0, T1s, 1, 0);
+/* assert EOI with last byte written, end reads on EOI or LF */
+inst = ibdev(GPIB_BOARD_ID, pad, 0, gpib_tmo, 1, REOS | GPIB_EOS);
 if(inst < 0)
     {
     fprintf(stderr, "Error trying to open GPIB address %i\n", pad);
@@ -573,7 +2245,7 @@ if(inst < 0)
 if (do_reset)
     {
     strcpy (buf, "OUT 0;RST;CLR\n");
-    if (ibwrt(inst, buf, strlen(buf)) & ERR )
+    if (bus_wrt(inst, buf) & ERR )
         {
         fprintf(stderr, "Error during init of GPIB address %i!\n", pad);
         return 0;
@@ -591,15 +2263,15 @@ return inst;
 * hp663X_set: Sets one parameter of the HP6633A      	*
 * Input:    - file pointer delivered by hp663X_open()   *
 *           - instruction ("VSET", ...)			*
-*	    - value for instruction ('13.6', ...)	*
+*	    - value for instruction, fixed point	*
 * Return:   1 if OK, 0 if error                         *
 ********************************************************/
-int hp663X_set (const int inst, const char cmd[], const float val)
+int hp663X_set (const int inst, const char cmd[], const long val)
 {
 static char buf[MAXLEN];
 
-sprintf (buf, "%s %f\n", cmd, val);
-if (ibwrt(inst, buf, strlen(buf)) & ERR )
+strcat (fix_put(buf + sprintf(buf, "%s ", cmd), val), "\n");
+if (bus_wrt(inst, buf) & ERR )
     {
     fprintf(stderr, "Error executing '%s'!\n", buf);
     return 0;
@@ -620,7 +2292,7 @@ int hp663X_setup (const int inst, const float volt,
 static char buf[MAXLEN];
 
 sprintf (buf, "VSET %f;ISET %f;OVSET %f;OCP %d\n", volt, amp, limvolt, (ocp ? 1:0));
-if (ibwrt(inst, buf, strlen(buf)) & ERR )
+if (bus_wrt(inst, buf) & ERR )
     {
     fprintf(stderr, "Error during mode setting!\n");
     return 0;
@@ -639,74 +2311,2367 @@ return 1;
 int hp663X_read (const int inst, const char what[], char *result)
 {
 static char buf[MAXLEN];
+double  t;
+int     n;
+
+t = timeinfo();
 
-/* send query string to instrument */
+/* send query string to instrument, and keep the board until
+   the reply is in */
 sprintf (buf, "%s\n", what);
+bus_lock();
 if (ibwrt(inst, buf, strlen(buf)) & ERR )
     {
+    bus_unlock();
     fprintf(stderr, "Error during read!\n");
     return 0;
     }
 
-/* read from instrument.The HP6633A sends always (?) 9 characters, 
-   the last 2 are a CR/LF sequence ... example:
+/* read from instrument. The HP6633A terminates its reply with a CR/LF
+   sequence, the read ends at the LF (or EOI) ... example:
    VOUT? --> ' 12.009'
    IOUT? --> '-0.0005'
  */
-if(ibrd(inst, result, 11) & ERR)
+ibrd(inst, result, MAXLEN-1);
+bus_unlock();
+if (ibsta & ERR)
     {
     fprintf(stderr, "Error trying to read from instrument!\n");
+    if (gpib_adapt && (ibsta & TIMO))  /* timed out: back off */
+        {
+        gpib_srtt = tmo_sec[gpib_tmo];
+        gpib_latency(inst, gpib_srtt);
+        }
     return 0;
     }
 
 //printf("\nreceived string:'%s', number of bytes read: %i\n", result, ibcnt);
 
 /* make sure string is null-terminated; 
-   at the same time, cut off CR/LF  */
-result[ibcnt-2] = 0x0;        
+   at the same time, cut off CR/LF, whatever the length was */
+n = ibcnt;
+while (n > 0 && (result[n-1] == '\n' || result[n-1] == '\r'))
+    n--;
+result[n] = 0x0;
+
+if (gpib_adapt)
+    gpib_latency(inst, timeinfo() - t);
 
 return 1;
 }
 
 
+/********************************************************
+* gpib_latency: Adapts the GPIB timeout to the observed *
+*               latency, like TCP does for its RTO.     *
+* Input:    - file ptr as delivered by hp663X_open()    *
+*           - latency of last transaction (s)           *
+* Return:   Nothing.                                    *
+********************************************************/
+void gpib_latency (const int inst, const double lat)
+{
+int     tmo;
+
+if (gpib_srtt == 0.0)       /* first transaction */
+    {
+    gpib_srtt = lat;
+    gpib_rttvar = lat / 2.0;
+    }
+else
+    {
+    gpib_rttvar = 0.75 * gpib_rttvar + 0.25 * fabs(gpib_srtt - lat);
+    gpib_srtt = 0.875 * gpib_srtt + 0.125 * lat;
+    }
+
+/* allow twice the usual worst case, but stay within limits */
+tmo = tmo_code(2.0 * (gpib_srtt + 4.0 * gpib_rttvar));
+if (tmo < tmo_code(TMO_MIN))
+    tmo = tmo_code(TMO_MIN);
+if (tmo > gpib_tmo_max)
+    tmo = gpib_tmo_max;
 
-/*********************************************************
-* hp663X_close: Reset and switch off HP66330             *
-* Input:    - file pointer as delivered by hp663X_open() *
-*           - flag if reset should be performed (0 = no) *
-* Return:   0 if error, 1 if OK                          *
-*********************************************************/
-int hp663X_close (const int inst, const char do_reset)
+if (tmo != gpib_tmo && !(ibtmo(inst, tmo) & ERR))
+    gpib_tmo = tmo;
+}
+
+
+/********************************************************
+* bus_open: Opens the lock file of a GPIB board, used   *
+*           to take turns with other processes on the   *
+*           same board.                                 *
+* Input:    board number                                *
+* Return:   1 if OK, 0 if error                         *
+********************************************************/
+int bus_open (const int board)
 {
-static char buf[15];
+char    name[MAXLEN];
 
-/*  if requested, perform a device clear */
-if (do_reset)
+sprintf (name, BUS_LOCK, board);
+if ((bus_fd = open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0666)) < 0)
     {
-    strcpy (buf, "OUT 0;RST;CLR\n");
-    if (ibwrt(inst, buf, strlen(buf)) & ERR )
-        {
-        fprintf(stderr, "Error during reset of instrument!\n");
-        return 0;
-        }
+    fprintf(stderr, "Could not open lock file '%s'.\n", name);
+    return 0;
     }
 return 1;
 }
 
 
 /********************************************************
-* TIMEINFO: Returns actual time elapsed since The Epoch *
-* Input:    Nothing.                                    *
-* Return:   time in microseconds                        *
-* Note:     #include <time.h>                           *
-*           #include <sys/time.h>                       *
+* bus_lock: Gets the GPIB board for ourselves, waiting  *
+*           for other processes if needed. Calls may be *
+*           nested; only the outermost one locks.       *
+* Input:    Nothing                                     *
+* Return:   Nothing.                                    *
 ********************************************************/
-double timeinfo (void)
+void bus_lock (void)
 {
-struct timeval t;
+double  t;
 
-gettimeofday(&t, NULL);
-return (double)t.tv_sec + (double)t.tv_usec/1000000.0;
+if (bus_fd < 0 || bus_depth++)
+    return;
+bus_n++;
+if (0 == flock(bus_fd, LOCK_EX | LOCK_NB))
+    return;
+t = timeinfo();             /* busy: wait, and keep track of it */
+while (flock(bus_fd, LOCK_EX) && errno == EINTR)
+    ;
+t = timeinfo() - t;
+bus_waits++;
+bus_wait_sum += t;
+if (t > bus_wait_max)
+    bus_wait_max = t;
+}
+
+
+/********************************************************
+* bus_unlock: Leaves the GPIB board to others.          *
+* Input:    Nothing                                     *
+* Return:   Nothing.                                    *
+********************************************************/
+void bus_unlock (void)
+{
+if (bus_fd < 0 || --bus_depth)
+    return;
+flock(bus_fd, LOCK_UN);
+}
+
+
+/********************************************************
+* bus_wrt:  ibwrt() with the board locked.              *
+* Input:    - file ptr as delivered by hp663X_open()    *
+*           - string to send                            *
+* Return:   ibsta                                       *
+********************************************************/
+int bus_wrt (const int inst, const char *buf)
+{
+int     sta;
+
+bus_lock();
+sta = ibwrt(inst, (char *)buf, strlen(buf));
+bus_unlock();
+return sta;
+}
+
+
+/********************************************************
+* TMO_CODE: Finds the shortest GPIB timeout setting     *
+*           (T10us ... T1000s) covering a duration      *
+* Input:    Duration in s                               *
+* Return:   Timeout code for ibdev() and ibtmo()        *
+********************************************************/
+int tmo_code (const double sec)
+{
+int     i;
+
+for (i = T10us; i < T1000s; i++)
+    if (tmo_sec[i] >= sec)
+        break;
+return i;
+}
+
+
+
+/********************************************************
+* hp663X_measure: Reads output voltage and current.     *
+* Input:    - file ptr as delivered by hp663X_open()    *
+*           - ptrs to long for voltage and current      *
+*             (fixed point)                             *
+*           - ptr to long long[4] for start and end of  *
+*             each reading (ns), or NULL                *
+* Return:   1 if OK, 0 if error                         *
+********************************************************/
+int hp663X_measure (const int inst, long *volt, long *amp, long long *ts)
+{
+static char buf[MAXLEN];
+long long t[4];
+int     ok = 0;
+
+bus_lock();         /* both readings in one go */
+t[0] = clock_ns();
+if (hp663X_read(inst, "VOUT?", buf))
+    {
+    t[1] = clock_ns();
+    if (0 == fix_parse(buf, volt))
+        fprintf(stderr, "Invalid reply '%s' to VOUT?\n", buf);
+    else
+        {
+        t[2] = clock_ns();
+        if (hp663X_read(inst, "IOUT?", buf))
+            {
+            t[3] = clock_ns();
+            if (0 == fix_parse(buf, amp))
+                fprintf(stderr, "Invalid reply '%s' to IOUT?\n", buf);
+            else
+                ok = 1;
+            }
+        }
+    }
+bus_unlock();
+if (ok && ts)
+    memcpy (ts, t, sizeof(t));
+return ok;
+}
+
+
+/********************************************************
+* hp663X_recover: Handles a failed GPIB transaction.    *
+*           Waits (doubling the wait after each of      *
+*           the first RETRY_MAX failures), then         *
+*           re-opens the device and the rails, and      *
+*           restores their settings.                    *
+* Input:    - ptr to file ptr from hp663X_open()        *
+*           - ptr to rails                              *
+*           - GPIB address                              *
+*           - number of consecutive failures so far     *
+*           - re-opens allowed (0 = no recovery at all) *
+*           - volt, amp, limvolt, ocp to restore        *
+* Return:   1 if to try again, -1 if the settings could *
+*           not be restored (counts as a failure, so    *
+*           re-open again), 0 if to give up             *
+********************************************************/
+int hp663X_recover (int *inst, struct rails *r, const int pad, const int fails, const int max_reconnect,
+                    const float volt, const float amp, const float limvolt, const char ocp)
+{
+double  wait;
+int     dev, i;
+
+if (max_reconnect == 0 || fails > RETRY_MAX + max_reconnect)
+    return 0;               /* no recovery wanted, or given up */
+
+wait = RETRY_WAIT * (1 << (fails > RETRY_MAX ? RETRY_MAX : fails-1));
+if (wait > RETRY_MAXWAIT)
+    wait = RETRY_MAXWAIT;
+usleep ((useconds_t)(wait * 1000000.0));
+
+if (fails <= RETRY_MAX)     /* plain retry */
+    return 1;
+
+/* re-open the device, clear it and restore the settings */
+fprintf(stderr, "Re-opening GPIB address %i ...\n", pad);
+ibonl(*inst, 0);
+if (0 == (dev = hp663X_open(pad, 0)))
+    return -1;              /* try again later */
+*inst = dev;
+bus_lock();
+ibclr(dev);
+bus_unlock();
+if ((ibsta & ERR) || 0 == hp663X_setup(dev, volt, amp, limvolt, ocp))
+    return -1;
+for (i = 0; i < r->n; i++)  /* the rails may have gone, too */
+    {
+    if (r->dev[i])
+        ibonl(r->dev[i], 0);
+    if (0 == (r->dev[i] = hp663X_open(r->pad[i], 0)))
+        return -1;
+    bus_lock();
+    ibclr(r->dev[i]);
+    bus_unlock();
+    if ((ibsta & ERR) || 0 == hp663X_setup(r->dev[i], volt, amp, limvolt, ocp))
+        return -1;
+    }
+return 1;
+}
+
+
+/********************************************************
+* hp663X_probe: Characterises the GPIB link by timing   *
+*               a burst of VOUT?/IOUT? reading pairs.   *
+* Input:    - file ptr as delivered by hp663X_open()    *
+*           - number of reading pairs                   *
+*           - ptr to double[4] for min, median, 95 %    *
+*             and max time per pair (s)                 *
+* Return:   1 if OK, 0 if error                         *
+********************************************************/
+int hp663X_probe (const int inst, const int n, double *lat)
+{
+long    volt, amp;
+double  *dt, t;
+int     i;
+
+if (NULL == (dt = malloc(n * sizeof(double))))
+    {
+    fprintf(stderr, "Out of memory!\n");
+    return 0;
+    }
+
+for (i = 0; i < n; i++)
+    {
+    t = timeinfo();
+    if (0 == hp663X_measure(inst, &volt, &amp, NULL))
+        {
+        free (dt);
+        return 0;
+        }
+    dt[i] = timeinfo() - t;
+    }
+
+qsort (dt, n, sizeof(double), cmp_double);
+lat[0] = dt[0];
+lat[1] = dt[n/2];
+lat[2] = dt[(n*95)/100];
+lat[3] = dt[n-1];
+
+free (dt);
+return 1;
+}
+
+
+/*********************************************************
+* hp663X_close: Reset and switch off HP66330             *
+* Input:    - file pointer as delivered by hp663X_open() *
+*           - flag if reset should be performed (0 = no) *
+* Return:   0 if error, 1 if OK                          *
+*********************************************************/
+int hp663X_close (const int inst, const char do_reset)
+{
+static char buf[15];
+
+/*  if requested, perform a device clear */
+if (do_reset)
+    {
+    strcpy (buf, "OUT 0;RST;CLR\n");
+    if (bus_wrt(inst, buf) & ERR )
+        {
+        fprintf(stderr, "Error during reset of instrument!\n");
+        return 0;
+        }
+    }
+return 1;
+}
+
+
+/********************************************************
+* log_commit: Commits the data file: appends a line     *
+*           with sample count and CRC-32 of the file    *
+*           so far, syncs the file to disk and saves    *
+*           the checkpoint. Without checkpoint file     *
+*           (no -D), it just flushes the data out.      *
+* Input:    - file ptr as delivered by wr_open()        *
+*           - ptr to its writer                         *
+*           - ptr to checkpoint (offset, crc updated)   *
+* Return:   1 if OK, 0 if error                         *
+********************************************************/
+int log_commit (FILE *f, struct writer *w, struct checkpoint *cp)
+{
+char    line[MAXLEN];
+
+if (fflush(f))
+    return 0;
+if (NULL == w->statename)   /* hand over to the thread, so the plot sees it */
+    return (w->async && w->fill[w->cur] ? wr_submit(w, NULL) : 1);
+sprintf (line, "# Commit: %lu %08lx\n", cp->loop, w->crc);
+fputs (line, f);
+if (fflush(f))
+    return 0;
+cp->offset = w->pos;
+cp->crc = w->crc;
+return wr_sync(w, cp);
+}
+
+
+/********************************************************
+* log_header: Writes the header of the data file.       *
+* Input:    - file ptr                                  *
+*           - comment, additional header lines, titles  *
+*             of the data columns                       *
+*           - ptr to checkpoint (time base, segment)    *
+*           - flag if data file is segmented            *
+* Return:   Nothing.                                    *
+********************************************************/
+void log_header (FILE *f, const char *comment, const char *info, const char *columns,
+                 const struct checkpoint *cp, const char segmented)
+{
+time_t  t;
+
+time(&t);
+fprintf(f, "# hp6633 " VERSION "\n");
+fprintf(f, "# %s\n", comment);
+fprintf(f, "# Start: %s", ctime(&t));
+if (segmented)      /* 'min' always counts from start of run */
+    {
+    t = (time_t)(cp->t0 / 1000000000LL);
+    fprintf(f, "# Segment: %d, run started %s", cp->segment, ctime(&t));
+    }
+fprintf(f, "%s", info);
+fprintf(f, "# %s\n", columns);
+}
+
+
+/********************************************************
+* log_segment: Closes the current segment of the data   *
+*           file and opens the next one. The closed one *
+*           is listed in 'base.lst' and evtl. handed    *
+*           to a background process for compression.    *
+* Input:    - file ptr of current segment, its writer  *
+*           - base file name                            *
+*           - segment file name (updated)               *
+*           - ptr to checkpoint (updated)               *
+*           - current time, min                         *
+*           - flag if segment should be compressed      *
+* Return:   file ptr of new segment, NULL if error      *
+********************************************************/
+FILE *log_segment (FILE *f, struct writer *w, const char *base, char *segname,
+                   struct checkpoint *cp, const double t1, const char do_compress)
+{
+char    next[MAXLEN+8];
+pid_t   pid;
+
+sprintf (next, "%s.%03d", base, cp->segment + 1);
+fprintf(f, "# Continued: %s\n", next);
+log_commit(f, w, cp);
+fclose (f);
+
+if (do_compress)
+    {
+    sprintf (next, "%s.gz", segname);
+    log_list(base, next, cp, cp->loop, t1);
+    sprintf (next, "%s.%03d", base, cp->segment + 1);
+    }
+else
+    log_list(base, segname, cp, cp->loop, t1);
+
+/* compress in a grandchild (no zombies), with low priority */
+if (do_compress && (pid = fork()) == 0)
+    {
+    if (fork() == 0)
+        {
+        if (nice(19) == -1)
+            ;   /* never mind */
+        execlp(COMPRESS, COMPRESS, "-f", segname, (char *)NULL);
+        }
+    _exit(0);
+    }
+else if (do_compress && pid > 0)
+    waitpid(pid, NULL, 0);
+
+strcpy (segname, next);
+cp->segment++;
+cp->seg_first = cp->loop + 1;
+cp->seg_t = t1;
+cp->offset = 0L;
+cp->crc = 0L;
+
+return wr_open(w, segname, 0L, 0L, w->async);
+}
+
+
+/********************************************************
+* wr_open: Opens the data file as a stdio stream that   *
+*          keeps track of size and CRC of the data.     *
+*          If requested, the data are collected in      *
+*          WR_NBUF buffers, which are written by a      *
+*          separate thread, so that a slow disk does    *
+*          not hold up acquisition.                     *
+* Input:    - ptr to writer                             *
+*           - file name                                 *
+*           - length to keep (resume), or 0 for new     *
+*           - CRC-32 of what is kept                    *
+*           - flag if writer thread should be used      *
+* Return:   file ptr, NULL if error                     *
+********************************************************/
+FILE *wr_open (struct writer *w, const char *name, const long pos,
+               const unsigned long crc, const char async)
+{
+static cookie_io_functions_t io = { NULL, wr_write, NULL, wr_close };
+FILE    *f;
+int     i;
+
+w->fd = open(name, O_WRONLY | O_CREAT | (pos ? 0 : O_TRUNC), 0644);
+if (w->fd < 0)
+    {
+    fprintf(stderr, "Could not open '%s' for writing.\n", name);
+    return NULL;
+    }
+w->pos = w->wpos = pos;
+w->crc = crc;
+w->async = async;
+w->cur = w->head = w->queued = 0;
+w->stop = w->err = 0;
+
+if (async)
+    {
+    for (i = 0; i < WR_NBUF; i++)
+        {
+        if (NULL == (w->buf[i] = malloc(WR_BUFSIZE)))
+            {
+            fprintf(stderr, "Out of memory!\n");
+            return NULL;
+            }
+        w->fill[i] = 0;
+        w->sync[i] = 0;
+        }
+    pthread_mutex_init (&w->lock, NULL);
+    pthread_cond_init (&w->cond, NULL);
+    if (pthread_create(&w->thread, NULL, wr_thread, w))
+        {
+        fprintf(stderr, "Could not start thread for '%s'.\n", name);
+        return NULL;
+        }
+    }
+
+if (NULL == (f = fopencookie(w, "w", io)))
+    fprintf(stderr, "Could not open '%s' for writing.\n", name);
+return f;
+}
+
+
+/********************************************************
+* wr_write: stdio write function of the data file.      *
+* Input:    - ptr to writer                             *
+*           - ptr to data, and their length             *
+* Return:   number of bytes written, -1 if error        *
+********************************************************/
+ssize_t wr_write (void *cookie, const char *data, size_t n)
+{
+struct writer *w = cookie;
+size_t  k, done;
+ssize_t r;
+
+w->crc = crc32_update(w->crc, (const unsigned char *)data, n);
+
+if (!w->async)      /* write right away */
+    {
+    for (done = 0; done < n; done += r)
+        if ((r = pwrite(w->fd, data + done, n - done, w->pos + done)) <= 0)
+            return -1;
+    w->pos += n;
+    return n;
+    }
+
+for (done = 0; done < n; done += k)     /* copy to buffer(s) */
+    {
+    k = WR_BUFSIZE - w->fill[w->cur];
+    if (k > n - done)
+        k = n - done;
+    memcpy (w->buf[w->cur] + w->fill[w->cur], data + done, k);
+    w->fill[w->cur] += k;
+    if (w->fill[w->cur] == WR_BUFSIZE && 0 == wr_submit(w, NULL))
+        return -1;
+    }
+w->pos += n;
+return n;
+}
+
+
+/********************************************************
+* wr_submit: Hands the current buffer to the writer     *
+*           thread, and gets a free one (waiting for    *
+*           it if necessary).                           *
+* Input:    - ptr to writer                             *
+*           - checkpoint to save after syncing the file *
+*             to disk, or NULL                          *
+* Return:   1 if OK, 0 if error                         *
+********************************************************/
+int wr_submit (struct writer *w, const struct checkpoint *cp)
+{
+int     ok;
+
+pthread_mutex_lock (&w->lock);
+w->sync[w->cur] = (cp != NULL);
+if (cp)
+    w->cp[w->cur] = *cp;
+if (++w->queued > w->maxqueue)
+    w->maxqueue = w->queued;
+if (w->queued == WR_NBUF)   /* all buffers are waiting */
+    {
+    w->stalls++;
+    while (w->queued == WR_NBUF && !w->err)
+        pthread_cond_wait (&w->cond, &w->lock);
+    }
+w->cur = (w->head + w->queued) % WR_NBUF;
+w->fill[w->cur] = 0;
+ok = !w->err;
+pthread_cond_broadcast (&w->cond);
+pthread_mutex_unlock (&w->lock);
+return ok;
+}
+
+
+/********************************************************
+* wr_thread: Writes buffers handed over by wr_submit(). *
+* Input:    ptr to writer                               *
+* Return:   NULL                                        *
+********************************************************/
+void *wr_thread (void *arg)
+{
+struct writer *w = arg;
+double  t;
+size_t  done;
+ssize_t r;
+int     b;
+
+pthread_mutex_lock (&w->lock);
+for (;;)
+    {
+    while (!w->queued && !w->stop)
+        pthread_cond_wait (&w->cond, &w->lock);
+    if (!w->queued)             /* stopped, and all written */
+        break;
+    b = w->head;
+    pthread_mutex_unlock (&w->lock);
+
+    t = timeinfo();
+    for (done = 0, r = 1; done < w->fill[b] && r > 0; done += r)
+        r = pwrite(w->fd, w->buf[b] + done, w->fill[b] - done, w->wpos + done);
+    if (r > 0 && w->sync[b])    /* checkpoint only when data are safe */
+        r = !fsync(w->fd) && state_save(w->statename, &w->cp[b]);
+    t = timeinfo() - t;
+
+    pthread_mutex_lock (&w->lock);
+    if (r <= 0)
+        w->err = 1;
+    w->wpos += w->fill[b];
+    w->head = (w->head + 1) % WR_NBUF;
+    w->queued--;
+    w->writes++;
+    w->lat_sum += t;
+    if (t > w->lat_max)
+        w->lat_max = t;
+    pthread_cond_broadcast (&w->cond);
+    }
+pthread_mutex_unlock (&w->lock);
+return NULL;
+}
+
+
+/********************************************************
+* wr_sync: Makes sure all data reach the disk, then     *
+*          saves the checkpoint; with the writer        *
+*          thread, this is just requested.              *
+* Input:    - ptr to writer                             *
+*           - ptr to checkpoint                         *
+* Return:   1 if OK, 0 if error                         *
+********************************************************/
+int wr_sync (struct writer *w, const struct checkpoint *cp)
+{
+if (!w->async)
+    return !fsync(w->fd) && state_save(w->statename, cp);
+return wr_submit(w, cp);
+}
+
+
+/********************************************************
+* wr_close: stdio close function of the data file.      *
+*           Waits for the writer thread to finish.      *
+* Input:    ptr to writer                               *
+* Return:   0 if OK, -1 if error                        *
+********************************************************/
+int wr_close (void *cookie)
+{
+struct writer *w = cookie;
+int     i, err = 0;
+
+if (w->async)
+    {
+    if (w->fill[w->cur])
+        wr_submit(w, NULL);
+    pthread_mutex_lock (&w->lock);
+    w->stop = 1;
+    pthread_cond_broadcast (&w->cond);
+    pthread_mutex_unlock (&w->lock);
+    pthread_join (w->thread, NULL);
+    pthread_mutex_destroy (&w->lock);
+    pthread_cond_destroy (&w->cond);
+    for (i = 0; i < WR_NBUF; i++)
+        free (w->buf[i]);
+    err = w->err;
+    }
+if (close(w->fd) || err)
+    return -1;
+return 0;
+}
+
+
+/********************************************************
+* log_list: Adds a finished segment to 'base.lst'.      *
+* Input:    - base file name                            *
+*           - segment file name                         *
+*           - ptr to checkpoint (first sample, start)   *
+*           - last sample, and its time (min)           *
+* Return:   Nothing.                                    *
+********************************************************/
+void log_list (const char *base, const char *name, const struct checkpoint *cp,
+               const unsigned long last, const double t1)
+{
+char    lst[MAXLEN+4];
+FILE    *f;
+
+sprintf (lst, "%s.lst", base);
+if (NULL == (f = fopen(lst, "at")))
+    {
+    fprintf(stderr, "Could not open '%s' for writing.\n", lst);
+    return;
+    }
+fprintf(f, "%s\t%lu\t%lu\t%.4f\t%.4f\n", name, cp->seg_first, last, cp->seg_t, t1);
+fclose (f);
+}
+
+
+/********************************************************
+* log_verify: Checks data file against a checkpoint     *
+*           and truncates what was written after it.    *
+* Input:    - name of data file                         *
+*           - ptr to checkpoint                         *
+* Return:   1 if OK, 0 if error                         *
+********************************************************/
+int log_verify (const char *name, const struct checkpoint *cp)
+{
+static unsigned char buf[4096];
+FILE    *f;
+unsigned long crc = 0;
+long    off;
+size_t  n;
+
+if (NULL == (f = fopen(name, "rb")))
+    {
+    fprintf(stderr, "Could not open '%s' for reading.\n", name);
+    return 0;
+    }
+for (off = 0; off < cp->offset; off += n)
+    {
+    n = fread(buf, 1, (cp->offset - off > sizeof(buf) ? sizeof(buf) : cp->offset - off), f);
+    if (n == 0)
+        break;
+    crc = crc32_update(crc, buf, n);
+    }
+fclose (f);
+
+if (off != cp->offset || crc != cp->crc)
+    {
+    fprintf(stderr, "'%s' does not match its checkpoint.\n", name);
+    return 0;
+    }
+if (truncate(name, cp->offset))     /* drop torn record(s) */
+    {
+    fprintf(stderr, "Could not truncate '%s'.\n", name);
+    return 0;
+    }
+return 1;
+}
+
+
+/********************************************************
+* state_save: Writes the checkpoint file. A temporary   *
+*           file is renamed, so that there is always    *
+*           one complete checkpoint on disk.            *
+* Input:    - name of checkpoint file                   *
+*           - ptr to checkpoint                         *
+* Return:   1 if OK, 0 if error                         *
+********************************************************/
+int state_save (const char *name, const struct checkpoint *cp)
+{
+char    tmp[MAXLEN+10];
+FILE    *f;
+int     err;
+
+sprintf (tmp, "%s.tmp", name);
+if (NULL == (f = fopen(tmp, "wt")))
+    return 0;
+fprintf(f, "hp6633-state 1\n");
+fprintf(f, "%ld %08lx %lu %lld %d %d %lu %lu %d %lu %.6f %ld %lld %ld %ld %.9f %d %.6f %s\n",
+        cp->offset, cp->crc, cp->loop, cp->t0, cp->step, cp->dramp_avail, cp->retries, cp->reconnects,
+        cp->segment, cp->seg_first, cp->seg_t, cp->binpos,
+        cp->amp_sum, cp->amp_min, cp->amp_max, cp->charge, cp->violated, cp->t_violated,
+        (cp->violated ? cp->rule : "-"));   /* rules hold no blanks */
+err = fflush(f) || fsync(fileno(f));
+fclose (f);
+if (err || rename(tmp, name))
+    return 0;
+return 1;
+}
+
+
+/********************************************************
+* state_load: Reads the checkpoint file.                *
+* Input:    - name of checkpoint file                   *
+*           - ptr to checkpoint                         *
+* Return:   1 if OK, 0 if error                         *
+********************************************************/
+int state_load (const char *name, struct checkpoint *cp)
+{
+FILE    *f;
+char    buf[MAXLEN];
+int     dramp_avail, n = 0;
+
+if (NULL == (f = fopen(name, "rt")))
+    {
+    fprintf(stderr, "Could not open '%s' for reading.\n", name);
+    return 0;
+    }
+if (fgets(buf, MAXLEN, f) && !strcmp(buf, "hp6633-state 1\n"))
+    n = fscanf(f, "%ld %lx %lu %lld %d %d %lu %lu %d %lu %lf %ld %lld %ld %ld %lf %d %lf %80s",
+               &cp->offset, &cp->crc, &cp->loop, &cp->t0, &cp->step, &dramp_avail, &cp->retries, &cp->reconnects,
+               &cp->segment, &cp->seg_first, &cp->seg_t, &cp->binpos,
+               &cp->amp_sum, &cp->amp_min, &cp->amp_max, &cp->charge, &cp->violated, &cp->t_violated,
+               cp->rule);
+fclose (f);
+if (n != 19)
+    {
+    fprintf(stderr, "Invalid checkpoint file '%s'.\n", name);
+    return 0;
+    }
+cp->dramp_avail = dramp_avail;
+return 1;
+}
+
+
+/********************************************************
+* binlog_open: Opens the binary log. The file is        *
+*           allocated in large extents and mapped into  *
+*           memory; a thread syncs it to disk.          *
+* Input:    - ptr to binlog                             *
+*           - file name                                 *
+*           - time base, ns since The Epoch             *
+*           - length to keep (resume), or 0 for new     *
+* Return:   1 if OK, 0 if error                         *
+********************************************************/
+int binlog_open (struct binlog *bl, const char *name, const long long t0, const long pos)
+{
+struct binhdr hdr;
+
+memset (bl, 0, sizeof(*bl));
+bl->fd = open(name, O_RDWR | O_CREAT | (pos ? 0 : O_TRUNC), 0644);
+if (bl->fd < 0)
+    {
+    fprintf(stderr, "Could not open '%s' for writing.\n", name);
+    return 0;
+    }
+
+bl->len = ((pos + BIN_EXTENT) / BIN_EXTENT) * BIN_EXTENT;
+if (posix_fallocate(bl->fd, 0, bl->len) ||
+    MAP_FAILED == (bl->map = mmap(NULL, bl->len, PROT_READ | PROT_WRITE, MAP_SHARED, bl->fd, 0)))
+    {
+    fprintf(stderr, "Could not allocate '%s'.\n", name);
+    close (bl->fd);
+    return 0;
+    }
+
+if (pos)                    /* resume: keep what was committed */
+    {
+    memset (bl->map + pos, 0, bl->len - pos);
+    bl->pos = pos;
+    }
+else
+    {
+    memset (&hdr, 0, sizeof(hdr));
+    strcpy (hdr.magic, BIN_MAGIC);
+    hdr.version = BIN_VERSION;
+    hdr.recsize = sizeof(struct binrec);
+    hdr.t0 = t0;
+    memcpy (bl->map, &hdr, sizeof(hdr));
+    bl->pos = sizeof(hdr);
+    }
+
+pthread_mutex_init (&bl->lock, NULL);
+if (pthread_create(&bl->thread, NULL, binlog_sync, bl))
+    {
+    fprintf(stderr, "Could not start thread for '%s'.\n", name);
+    munmap (bl->map, bl->len);
+    close (bl->fd);
+    return 0;
+    }
+return 1;
+}
+
+
+/********************************************************
+* binlog_write: Stores one sample in the binary log.    *
+*           Normally just a copy to memory; every       *
+*           BIN_EXTENT, the file and its mapping grow.  *
+* Input:    - ptr to binlog                             *
+*           - time (ns), voltage, current (fixed point) *
+* Return:   1 if OK, 0 if error                         *
+********************************************************/
+int binlog_write (struct binlog *bl, const long long t, const long volt, const long amp)
+{
+struct binrec rec;
+int     ok = 1;
+
+if (bl->pos + sizeof(rec) > bl->len)
+    {
+    pthread_mutex_lock (&bl->lock);     /* wait for sync to finish */
+    munmap (bl->map, bl->len);
+    bl->len += BIN_EXTENT;
+    if (posix_fallocate(bl->fd, 0, bl->len) ||
+        MAP_FAILED == (bl->map = mmap(NULL, bl->len, PROT_READ | PROT_WRITE, MAP_SHARED, bl->fd, 0)))
+        {
+        fprintf(stderr, "Could not extend binary file!\n");
+        bl->map = NULL;
+        ok = 0;
+        }
+    pthread_mutex_unlock (&bl->lock);
+    if (!ok)
+        return 0;
+    }
+
+rec.t = t;
+rec.volt = volt;
+rec.amp = amp;
+memcpy (bl->map + bl->pos, &rec, sizeof(rec));
+bl->pos += sizeof(rec);
+return 1;
+}
+
+
+/********************************************************
+* binlog_sync: Thread syncing the binary log to disk    *
+*           every BIN_SYNC s.                           *
+* Input:    ptr to binlog                               *
+* Return:   NULL                                        *
+********************************************************/
+void *binlog_sync (void *arg)
+{
+struct binlog *bl = arg;
+int     i;
+
+while (!bl->stop)
+    {
+    pthread_mutex_lock (&bl->lock);
+    if (bl->map)
+        msync (bl->map, bl->pos, MS_SYNC);
+    pthread_mutex_unlock (&bl->lock);
+    for (i = 0; i < 10 * BIN_SYNC && !bl->stop; i++)
+        usleep (100000);
+    }
+return NULL;
+}
+
+
+/********************************************************
+* binlog_close: Syncs and closes the binary log, cuts   *
+*           off the unused part of the file.            *
+* Input:    ptr to binlog                               *
+* Return:   1 if OK, 0 if error                         *
+********************************************************/
+int binlog_close (struct binlog *bl)
+{
+int     ok = 1;
+
+bl->stop = 1;
+pthread_join (bl->thread, NULL);
+if (bl->map)
+    {
+    ok = !msync(bl->map, bl->pos, MS_SYNC);
+    munmap (bl->map, bl->len);
+    }
+ok = !ftruncate(bl->fd, bl->pos) && ok;
+ok = !close(bl->fd) && ok;
+pthread_mutex_destroy (&bl->lock);
+return ok;
+}
+
+
+/********************************************************
+* sink_open: Opens an additional output.                *
+* Input:    - ptr to sink                               *
+*           - "-" for stdout, "tcp:port" for a TCP      *
+*             server, else name of a text file          *
+*           - titles of the data columns                *
+*           - 1 to append to an existing file (-A)      *
+* Return:   1 if OK, 0 if error                         *
+********************************************************/
+int sink_open (struct sink *k, const char *spec, const char *columns, const char append)
+{
+struct sockaddr_in addr;
+struct stat st;
+long    pos = 0L;
+int     port, on = 1;
+
+memset (k, 0, sizeof(*k));
+strncpy (k->name, spec, MAXLEN-1);
+sprintf (k->head, "# %s\n", columns);
+
+if (!strcmp(spec, "-"))                 /* stdout, never blocking */
+    {
+    k->type = SINK_STDOUT;
+    k->n = 1;
+    k->flags = -1;
+    /* O_NONBLOCK goes with the open file description, which stdout
+       may share with stderr (e.g. on a terminal), where the console
+       output goes: so open one of our own, or else stay blocking */
+    if ((k->s[0].fd = open("/proc/self/fd/1", O_WRONLY | O_APPEND | O_NONBLOCK | O_CLOEXEC)) < 0)
+        {
+        k->s[0].fd = STDOUT_FILENO;
+        if (!isatty(STDOUT_FILENO) && !isatty(STDERR_FILENO))
+            {
+            k->flags = fcntl(STDOUT_FILENO, F_GETFL);
+            fcntl(STDOUT_FILENO, F_SETFL, k->flags | O_NONBLOCK);
+            }
+        }
+    stream_put(&k->s[0], k->head, strlen(k->head));
+    return 1;
+    }
+
+if (1 == sscanf(spec, "tcp:%5d", &port))   /* live feed for any client */
+    {
+    k->type = SINK_TCP;
+    memset (&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if ((k->lfd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+        setsockopt(k->lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) ||
+        bind(k->lfd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        listen(k->lfd, MAXCLIENTS) ||
+        fcntl(k->lfd, F_SETFL, O_NONBLOCK))
+        {
+        fprintf(stderr, "Could not open TCP port %d.\n", port);
+        return 0;
+        }
+    return 1;
+    }
+
+k->type = SINK_FILE;                    /* text file, own writer thread */
+if (append && !stat(spec, &st))         /* resume: carry on at the end */
+    pos = st.st_size;
+if (NULL == (k->f = wr_open(&k->w, spec, pos, 0L, 1)))
+    return 0;
+if (pos == 0L)
+    fputs (k->head, k->f);
+return 1;
+}
+
+
+/********************************************************
+* sink_put: Passes a line of text to all sinks.         *
+* Input:    - array of sinks, number of sinks           *
+*           - text                                      *
+* Return:   Nothing.                                    *
+********************************************************/
+void sink_put (struct sink *k, const int n, const char *line)
+{
+size_t  len = strlen(line);
+int     i, j, fd;
+
+for (i = 0; i < n; i++, k++)
+    {
+    if (k->type == SINK_FILE)
+        {
+        fputs (line, k->f);
+        continue;
+        }
+    if (k->type == SINK_TCP)            /* accept new clients */
+        while (k->n < MAXCLIENTS && (fd = accept(k->lfd, NULL, NULL)) >= 0)
+            {
+            fcntl(fd, F_SETFL, O_NONBLOCK);
+            memset (&k->s[k->n], 0, sizeof(struct stream));
+            k->s[k->n].fd = fd;
+            stream_put(&k->s[k->n++], k->head, strlen(k->head));
+            }
+    for (j = 0; j < k->n; j++)
+        if (0 == stream_put(&k->s[j], line, len) && k->type == SINK_TCP)
+            {
+            close (k->s[j].fd);         /* client has gone */
+            k->drops += k->s[j].drops;
+            k->s[j--] = k->s[--k->n];
+            }
+    }
+}
+
+
+/********************************************************
+* stream_put: Writes to a non-blocking stream. What     *
+*           cannot be written right away is kept in     *
+*           a buffer; if that is full, data are dropped *
+*           rather than waiting for a slow reader.      *
+* Input:    - ptr to stream                             *
+*           - data and their length                     *
+* Return:   1 if OK, 0 if stream is broken              *
+********************************************************/
+int stream_put (struct stream *s, const char *data, size_t len)
+{
+ssize_t r;
+
+if (s->fill)                /* first try to get rid of old data */
+    {
+    r = send(s->fd, s->buf, s->fill, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (r < 0 && errno == ENOTSOCK)
+        r = write(s->fd, s->buf, s->fill);
+    if (r < 0 && errno != EAGAIN)
+        return 0;
+    if (r > 0)
+        {
+        memmove (s->buf, s->buf + r, s->fill - r);
+        s->fill -= r;
+        }
+    }
+
+r = 0;
+if (!s->fill)               /* nothing pending, try directly */
+    {
+    r = send(s->fd, data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (r < 0 && errno == ENOTSOCK)
+        r = write(s->fd, data, len);
+    if (r < 0 && errno != EAGAIN)
+        return 0;
+    if (r < 0)
+        r = 0;
+    }
+if (len - r > SINK_BUF - s->fill)   /* reader is too slow */
+    {
+    s->drops++;
+    return 1;
+    }
+memcpy (s->buf + s->fill, data + r, len - r);
+s->fill += len - r;
+return 1;
+}
+
+
+/********************************************************
+* sink_flush: Hands buffered data of the sinks on.      *
+* Input:    - array of sinks, number of sinks           *
+* Return:   Nothing.                                    *
+********************************************************/
+void sink_flush (struct sink *k, const int n)
+{
+int     i;
+
+for (i = 0; i < n; i++, k++)
+    if (k->type == SINK_FILE)
+        {
+        fflush (k->f);
+        if (k->w.fill[k->w.cur])
+            wr_submit(&k->w, NULL);
+        }
+}
+
+
+/********************************************************
+* sink_close: Closes all sinks, after writing what is   *
+*             still queued, and gives stdout back its   *
+*             flags.                                    *
+* Input:    - array of sinks, number of sinks           *
+* Return:   Nothing.                                    *
+********************************************************/
+void sink_close (struct sink *k, const int n)
+{
+struct timeval tmo = { 1, 0 };
+struct stream *s;
+ssize_t r;
+int     i, j;
+
+for (i = 0; i < n; i++, k++)
+    {
+    if (k->type == SINK_FILE && fclose(k->f))
+        fprintf(stderr, "\nError writing to '%s'.\n", k->name);
+    for (j = 0; j < k->n; j++)
+        {
+        s = &k->s[j];
+        if (k->type == SINK_STDOUT && k->flags >= 0)    /* as found */
+            fcntl(s->fd, F_SETFL, k->flags);
+        else if (k->type == SINK_STDOUT)    /* our own, or blocking anyway */
+            fcntl(s->fd, F_SETFL, fcntl(s->fd, F_GETFL) & ~O_NONBLOCK);
+        else                            /* blocking, but not for ever */
+            {
+            fcntl(s->fd, F_SETFL, 0);
+            setsockopt(s->fd, SOL_SOCKET, SO_SNDTIMEO, &tmo, sizeof(tmo));
+            }
+        while (s->fill && (r = write(s->fd, s->buf, s->fill)) > 0)
+            {
+            memmove (s->buf, s->buf + r, s->fill - r);
+            s->fill -= r;
+            }
+        k->drops += s->drops;
+        if (k->type == SINK_TCP || s->fd != STDOUT_FILENO)
+            close (s->fd);
+        }
+    if (k->type == SINK_TCP)
+        close (k->lfd);
+    if (k->drops)
+        fprintf(stderr, "\n'%s': %lu lines dropped.", k->name, k->drops);
+    }
+}
+
+
+/********************************************************
+* tier_open: Opens the summary files, 'base.<len>m'.    *
+*           On resume, they are appended to; a bucket   *
+*           that was not finished then is lost.         *
+* Input:    - ptr to array of summary files, and number *
+*           - base file name                            *
+*           - comment                                   *
+*           - flag for resume                           *
+* Return:   1 if OK, 0 if error                         *
+********************************************************/
+int tier_open (struct tier *t, const int n, const char *base, const char *comment,
+               const char resume)
+{
+time_t  tm;
+int     i;
+
+time(&tm);
+for (i = 0; i < n; i++, t++)
+    {
+    sprintf (t->name, "%s.%dm", base, t->len);
+    if (NULL == (t->f = fopen(t->name, resume ? "at" : "wt")))
+        {
+        fprintf(stderr, "Could not open '%s' for writing.\n", t->name);
+        while (i--)             /* close the ones already open */
+            fclose ((--t)->f);
+        return 0;
+        }
+    t->bucket = -1LL;
+    t->tlast = 0LL;
+    t->n = 0;
+    if (!resume)
+        {
+        fprintf(t->f, "# hp6633 " VERSION "\n");
+        fprintf(t->f, "# %s\n", comment);
+        fprintf(t->f, "# Start: %s", ctime(&tm));
+        fprintf(t->f, "# Summary of '%s' every %d min\n", base, t->len);
+        fprintf(t->f, "# min\tVolt min\tVolt mean\tVolt max\tAmpere min\tAmpere mean\tAmpere max\tAh\tReadings\n");
+        }
+    }
+return 1;
+}
+
+
+/********************************************************
+* tier_write: Writes one line for the current bucket.   *
+* Input:    ptr to summary file                         *
+* Return:   Nothing.                                    *
+********************************************************/
+void tier_write (struct tier *t)
+{
+char    line[2*MAXLEN], *p;
+
+p = fix_put(line, t->bucket * t->len * FIX_SCALE);
+*p++ = '\t';
+p = fix_put(p, t->vmin);
+*p++ = '\t';
+p = fix_put(p, llround((double)t->vsum / t->n));
+*p++ = '\t';
+p = fix_put(p, t->vmax);
+*p++ = '\t';
+p = fix_put(p, t->imin);
+*p++ = '\t';
+p = fix_put(p, llround((double)t->isum / t->n));
+*p++ = '\t';
+p = fix_put(p, t->imax);
+sprintf (p, "\t%.6f\t%lu\n", t->ah, t->n);
+fputs (line, t->f);
+}
+
+
+/********************************************************
+* tier_add: Adds a reading to all summary files; when   *
+*           it falls into a new bucket, the previous    *
+*           one is written. The charge is the current   *
+*           integrated over time (trapezoids), so that  *
+*           it does not depend on the sampling rate; a  *
+*           trapezoid across the start of a bucket is   *
+*           split there, and none is taken over a gap,  *
+*           like for the total charge.                  *
+* Input:    - ptr to array of summary files, and number *
+*           - time since start, ns                      *
+*           - voltage and current (fixed point)         *
+*           - flag if the reading follows a gap         *
+* Return:   Nothing.                                    *
+********************************************************/
+void tier_add (struct tier *t, const int n, const long long tns, const long volt,
+               const long amp, const char gap)
+{
+long long b, tb, len;
+double  i0;
+int     i;
+
+for (i = 0; i < n; i++, t++)
+    {
+    len = t->len * 60000000000LL;
+    b = tns / len;
+    i0 = t->ilast;
+    if (gap)
+        t->tlast = 0LL;
+    if (b != t->bucket)
+        {
+        tb = b * len;
+        if (t->tlast && t->n && tb > t->tlast && tns > tb)
+            {                   /* the part up to the start goes to the old bucket */
+            i0 = t->ilast + (double)(amp - t->ilast) * (tb - t->tlast) / (tns - t->tlast);
+            t->ah += (t->ilast + i0) / 2 / FIX_SCALE * (tb - t->tlast) / 3.6e12;
+            t->tlast = tb;
+            }
+        if (t->n)
+            tier_write(t);
+        t->bucket = b;
+        t->n = 0;
+        t->vsum = t->isum = 0LL;
+        t->vmin = t->vmax = volt;
+        t->imin = t->imax = amp;
+        t->ah = 0.0;
+        }
+    if (t->tlast)           /* charge since the last reading */
+        t->ah += (i0 + amp) / 2 / FIX_SCALE * (tns - t->tlast) / 3.6e12;
+    t->tlast = tns;
+    t->ilast = amp;
+    t->n++;
+    t->vsum += volt;
+    t->isum += amp;
+    if (volt < t->vmin) t->vmin = volt;
+    if (volt > t->vmax) t->vmax = volt;
+    if (amp < t->imin) t->imin = amp;
+    if (amp > t->imax) t->imax = amp;
+    }
+}
+
+
+/********************************************************
+* tier_flush: Hands what is written to the system.      *
+* Input:    - ptr to array of summary files, and number *
+* Return:   Nothing.                                    *
+********************************************************/
+void tier_flush (struct tier *t, const int n)
+{
+int     i;
+
+for (i = 0; i < n; i++, t++)
+    fflush (t->f);
+}
+
+
+/********************************************************
+* tier_close: Writes the last (incomplete) bucket and   *
+*           closes the summary files.                   *
+* Input:    - ptr to array of summary files, and number *
+* Return:   Nothing.                                    *
+********************************************************/
+void tier_close (struct tier *t, const int n)
+{
+int     i;
+
+for (i = 0; i < n; i++, t++)
+    {
+    if (t->n)
+        tier_write(t);
+    if (fclose(t->f))
+        fprintf(stderr, "\nError writing to '%s'.\n", t->name);
+    }
+}
+
+
+/********************************************************
+* plot_open: Starts gnuplot (or whatever 'cmd' is) with *
+*           a small, non-blocking pipe to its stdin, so *
+*           that a stalled gnuplot cannot hold up       *
+*           sampling, and is noticed soon.              *
+*           Optionally, its stdout comes back through a *
+*           second pipe, for acknowledgements.          *
+* Input:    - ptr to plot channel                       *
+*           - command to run                            *
+*           - nice() increment for it, 0 = as we are    *
+*           - flag for the back channel                 *
+* Return:   1 if OK, 0 if error                         *
+********************************************************/
+int plot_open (struct plot *p, const char *cmd, const int prio, const char ack)
+{
+int     fds[2], acks[2] = { -1, -1 };
+
+memset (p, 0, sizeof(*p));
+p->fd = p->ack = -1;
+if (pipe(fds))
+    return 0;
+if (ack && pipe(acks))
+    {
+    close (fds[0]);
+    close (fds[1]);
+    return 0;
+    }
+if ((p->pid = fork()) < 0)
+    {
+    close (fds[0]);
+    close (fds[1]);
+    if (ack)
+        {
+        close (acks[0]);
+        close (acks[1]);
+        }
+    return 0;
+    }
+if (0 == p->pid)                /* child */
+    {
+    dup2 (fds[0], STDIN_FILENO);
+    close (fds[0]);
+    close (fds[1]);
+    if (ack)
+        {
+        dup2 (acks[1], STDOUT_FILENO);
+        close (acks[0]);
+        close (acks[1]);
+        }
+    if (prio && nice(prio) < 0)
+        _exit (127);
+    execl ("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+    _exit (127);
+    }
+close (fds[0]);
+p->fd = fds[1];
+#ifdef F_SETPIPE_SZ
+fcntl (p->fd, F_SETPIPE_SZ, PLOT_PIPE);   /* else 64 kB pile up unseen */
+#endif
+fcntl (p->fd, F_SETFL, fcntl(p->fd, F_GETFL) | O_NONBLOCK);
+fcntl (p->fd, F_SETFD, FD_CLOEXEC);
+if (ack)
+    {
+    close (acks[1]);
+    p->ack = acks[0];
+    fcntl (p->ack, F_SETFL, fcntl(p->ack, F_GETFL) | O_NONBLOCK);
+    fcntl (p->ack, F_SETFD, FD_CLOEXEC);
+    }
+return 1;
+}
+
+
+/********************************************************
+* plot_ack: Collects the acknowledgements (one line     *
+*           each) that gnuplot has sent for finished    *
+*           jobs.                                       *
+* Input:    - ptr to plot channel                       *
+*           - flag to wait until all jobs are done      *
+* Return:   number of jobs finished since last call     *
+********************************************************/
+int plot_ack (struct plot *p, const char wait)
+{
+char    buf[64];
+ssize_t r;
+int     i, n = 0;
+
+if (p->ack < 0)
+    return 0;
+if (wait && p->pending)         /* hand over everything, then block */
+    {
+    fcntl (p->fd, F_SETFL, fcntl(p->fd, F_GETFL) & ~O_NONBLOCK);
+    plot_pump(p);
+    fcntl (p->fd, F_SETFL, fcntl(p->fd, F_GETFL) | O_NONBLOCK);
+    fcntl (p->ack, F_SETFL, fcntl(p->ack, F_GETFL) & ~O_NONBLOCK);
+    }
+while (p->pending > 0)
+    {
+    r = read(p->ack, buf, sizeof(buf));
+    if (r < 0 && errno == EINTR)
+        continue;
+    if (r == 0)                 /* gnuplot has gone */
+        p->pending = 0;
+    if (r <= 0)
+        break;
+    for (i = 0; i < r && p->pending > 0; i++)
+        if (buf[i] == '\n')
+            {
+            p->pending--;
+            n++;
+            }
+    }
+if (wait)
+    fcntl (p->ack, F_SETFL, fcntl(p->ack, F_GETFL) | O_NONBLOCK);
+return n;
+}
+
+
+/********************************************************
+* plot_pump: Passes queued commands on to gnuplot, as   *
+*           far as the pipe takes them.                 *
+* Input:    ptr to plot channel                         *
+* Return:   Nothing.                                    *
+********************************************************/
+void plot_pump (struct plot *p)
+{
+ssize_t r;
+
+while (p->len)
+    {
+    r = write(p->fd, p->buf, p->len);
+    if (r < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (r <= 0)                 /* gnuplot has gone */
+        {
+        p->len = 0;
+        return;
+        }
+    memmove (p->buf, p->buf + r, p->len - r);
+    p->len -= r;
+    }
+}
+
+
+/********************************************************
+* plot_printf: Sends a command to gnuplot. A refresh    *
+*           ('drop' set) is skipped while gnuplot has   *
+*           not yet acknowledged the previous one (or,  *
+*           without back channel, not yet taken the     *
+*           previous commands); as it re-reads the data *
+*           file, the next refresh shows everything     *
+*           anyway, so at most one is outstanding.      *
+* Input:    - ptr to plot channel                       *
+*           - flag if command may be skipped            *
+*           - format and arguments as for printf()      *
+* Return:   1 if queued, 0 if skipped                   *
+********************************************************/
+int plot_printf (struct plot *p, const char drop, const char *fmt, ...)
+{
+va_list ap;
+int     n;
+
+if (p->fd < 0)
+    return 0;
+plot_pump(p);
+if (drop)
+    plot_ack(p, 0);
+if (drop && (p->len || p->pending))
+    {
+    p->skipped++;
+    return 0;
+    }
+va_start (ap, fmt);
+n = vsnprintf(p->buf + p->len, PLOT_BUF - p->len, fmt, ap);
+va_end (ap);
+if (n < 0 || (size_t)n >= PLOT_BUF - p->len)    /* does not fit */
+    {
+    p->skipped++;
+    return 0;
+    }
+p->len += n;
+if (drop && p->ack >= 0 && p->len + 11 < PLOT_BUF)
+    {
+    p->len += sprintf(p->buf + p->len, "print 'ok'\n");
+    p->pending++;
+    }
+plot_pump(p);
+return 1;
+}
+
+
+/********************************************************
+* plot_close: Passes on what is left, closes the pipe,  *
+*           and waits for gnuplot to end.               *
+* Input:    ptr to plot channel                         *
+* Return:   Nothing.                                    *
+********************************************************/
+void plot_close (struct plot *p)
+{
+if (p->fd < 0)
+    return;
+fcntl (p->fd, F_SETFL, fcntl(p->fd, F_GETFL) & ~O_NONBLOCK);
+plot_pump(p);
+close (p->fd);
+waitpid (p->pid, NULL, 0);
+if (p->ack >= 0)
+    close (p->ack);
+p->fd = p->ack = -1;
+}
+
+
+/********************************************************
+* snapshot: Has a (low priority) gnuplot render the     *
+*           in-memory trace to an image file. Skipped   *
+*           until gnuplot has acknowledged the last one *
+*           (unless forced: then it waits for it).      *
+*           The image is written under a temporary name *
+*           and renamed once acknowledged, so that      *
+*           readers never see a half-written file.      *
+* Input:    - ptr to plot channel                       *
+*           - ptr to trace                              *
+*           - name of data file (used as base name)     *
+*           - flag for SVG instead of PNG               *
+*           - flag for I-V plot                         *
+*           - flag if it must not be skipped            *
+* Return:   1 if OK, 0 if skipped or error              *
+********************************************************/
+int snapshot (struct plot *p, const struct trace *tr, const char *base,
+              const char svg, const char ramp, const char force)
+{
+char    data[MAXLEN+10], tmp[MAXLEN+10], image[MAXLEN+10], itmp[MAXLEN+10];
+FILE    *f;
+int     i;
+
+if (p->fd < 0 || tr->n == 0)
+    return 0;
+sprintf (image, "%s.%s", base, svg ? "svg" : "png");
+sprintf (itmp, "%s.%s~", base, svg ? "svg" : "png");
+plot_pump(p);
+if (plot_ack(p, force))     /* the last one is done: show it */
+    rename (itmp, image);
+if (p->pending)             /* still busy with the last one */
+    {
+    p->skipped++;
+    return 0;
+    }
+
+/* the trace goes to a file of its own, so gnuplot sees a fixed amount */
+sprintf (data, "%s.snap", base);
+sprintf (tmp, "%s.snap~", base);
+if (NULL == (f = fopen(tmp, "w")))
+    return 0;
+for (i = 0; i < tr->n; i++)
+    fprintf(f, "%.4f\t%.4f\t%.4f\n", tr->x[i], tr->y1[i], tr->y2[i]);
+if (fclose(f) || rename(tmp, data))
+    return 0;
+
+if (ramp)                   /* busy was checked above */
+    i = plot_printf(p, 0,
+        "set output '%s'\nplot '%s' using 2:3 ti 'I vs. U'\nset output\nprint 'ok'\n",
+        itmp, data);
+else
+    i = plot_printf(p, 0,
+        "set output '%s'\nplot '%s' using 1:2 title 'Voltage', '' u 1:3 axis x1y2 title 'Current'\n"
+        "set output\nprint 'ok'\n", itmp, data);
+if (i == 0)
+    return 0;
+p->pending++;
+if (force && plot_ack(p, 1))
+    rename (itmp, image);
+return 1;
+}
+
+
+/********************************************************
+* trace_add: Adds a point to the in-memory trace. When  *
+*           the trace is full, every second point is    *
+*           dropped and only every second new point is  *
+*           taken from now on, so memory stays fixed.   *
+* Input:    - ptr to trace                              *
+*           - x, y1, y2                                 *
+* Return:   Nothing.                                    *
+********************************************************/
+void trace_add (struct trace *tr, const float x, const float y1, const float y2)
+{
+int     i;
+
+if (tr->dec == 0)           /* first call */
+    tr->dec = 1;
+if (++tr->skip < tr->dec)
+    return;
+tr->skip = 0;
+
+if (tr->n == TRACE_LEN)     /* decimate */
+    {
+    for (i = 0; i < TRACE_LEN/2; i++)
+        {
+        tr->x[i] = tr->x[2*i];
+        tr->y1[i] = tr->y1[2*i];
+        tr->y2[i] = tr->y2[2*i];
+        }
+    tr->n = TRACE_LEN/2;
+    tr->dec *= 2;
+    }
+tr->x[tr->n] = x;
+tr->y1[tr->n] = y1;
+tr->y2[tr->n] = y2;
+tr->n++;
+}
+
+
+/********************************************************
+* tui_open: Prepares the terminal for the chart.        *
+* Input:    - ptr to chart                              *
+*           - stream of the terminal                    *
+* Return:   Nothing.                                    *
+********************************************************/
+void tui_open (struct tui *ui, FILE *term)
+{
+memset (ui, 0, sizeof(*ui));
+ui->term = term;
+fprintf(term, "\033[?25l");     /* hide cursor */
+}
+
+
+/********************************************************
+* tui_panel: Plots y over x into a part of the chart.   *
+* Input:    - ptr to chart                              *
+*           - first row and number of rows (incl. the   *
+*             label row) of the panel                   *
+*           - x and y data, number of points            *
+*           - label and units                           *
+* Return:   Nothing.                                    *
+********************************************************/
+void tui_panel (struct tui *ui, const int top, const int height,
+                const float *x, const float *y, const int n,
+                const char *name, const char *unit, const char *xunit)
+{
+static const unsigned char dot[4][2] =  /* braille dots, [row][col] */
+    { {0x01, 0x08}, {0x02, 0x10}, {0x04, 0x20}, {0x40, 0x80} };
+float   xmin, xmax, ymin, ymax;
+int     i, px, py, w = 2 * ui->cols, h = 4 * (height - 1);
+
+if (n < 1 || h < 4)
+    return;
+xmin = xmax = x[0];
+ymin = ymax = y[0];
+for (i = 1; i < n; i++)
+    {
+    if (x[i] < xmin) xmin = x[i];
+    if (x[i] > xmax) xmax = x[i];
+    if (y[i] < ymin) ymin = y[i];
+    if (y[i] > ymax) ymax = y[i];
+    }
+if (xmax <= xmin)
+    xmax = xmin + 1e-6;
+if (ymax <= ymin)
+    ymax = ymin + 1e-4;
+
+snprintf (ui->label[top], MAXLEN, "%s: %.4f ... %.4f %s  (%.4g ... %.4g %s)",
+          name, ymin, ymax, unit, xmin, xmax, xunit);
+
+for (i = 0; i < n; i++)
+    {
+    px = (int)((x[i] - xmin) / (xmax - xmin) * (w - 1) + 0.5);
+    py = h - 1 - (int)((y[i] - ymin) / (ymax - ymin) * (h - 1) + 0.5);
+    ui->next[(top + 1 + py/4) * ui->cols + px/2] |= dot[py % 4][px % 2];
+    }
+}
+
+
+/********************************************************
+* tui_draw: Draws the chart: V and I over time, or I    *
+*           over V when ramping. Only cells that have   *
+*           changed since the last frame are sent, and  *
+*           at most TUI_HZ frames per second.           *
+* Input:    - ptr to chart                              *
+*           - ptr to trace                              *
+*           - flag for I-V chart                        *
+* Return:   Nothing.                                    *
+********************************************************/
+void tui_draw (struct tui *ui, const struct trace *tr, const char ramp)
+{
+struct winsize ws;
+int     i, rows = 24, cols = 80, size;
+unsigned char c;
+
+if (timeinfo() - ui->tlast < 1.0 / TUI_HZ)
+    return;
+ui->tlast = timeinfo();
+
+if (!ioctl(fileno(ui->term), TIOCGWINSZ, &ws) && ws.ws_row > 4 && ws.ws_col > 10)
+    {
+    rows = ws.ws_row;
+    cols = ws.ws_col;
+    }
+if (rows > TUI_MAXROWS)
+    rows = TUI_MAXROWS;
+if (rows != ui->rows || cols != ui->cols)   /* (re)start from scratch */
+    {
+    ui->rows = rows;
+    ui->cols = cols;
+    free (ui->cell);
+    free (ui->next);
+    size = rows * cols;
+    ui->cell = calloc(size, 1);
+    ui->next = calloc(size, 1);
+    memset (ui->shown, 0, sizeof(ui->shown));
+    fprintf(ui->term, "\033[2J");
+    }
+if (!ui->cell || !ui->next)
+    return;
+
+/* the last row is left to the status line */
+memset (ui->next, 0, rows * cols);
+memset (ui->label, 0, sizeof(ui->label));
+if (ramp)
+    tui_panel(ui, 0, rows - 1, tr->y1, tr->y2, tr->n, "Current", "A", "V");
+else
+    {
+    tui_panel(ui, 0, (rows - 1) / 2, tr->x, tr->y1, tr->n, "Voltage", "V", "min");
+    tui_panel(ui, (rows - 1) / 2, rows - 1 - (rows - 1) / 2, tr->x, tr->y2, tr->n, "Current", "A", "min");
+    }
+
+for (i = 0; i < rows - 1; i++)      /* labels */
+    if (strcmp(ui->label[i], ui->shown[i]))
+        {
+        fprintf(ui->term, "\033[%d;1H\033[K%s", i + 1, ui->label[i]);
+        strcpy (ui->shown[i], ui->label[i]);
+        }
+
+for (i = 0; i < (rows - 1) * cols; i++)     /* changed cells only */
+    if (ui->next[i] != ui->cell[i])
+        {
+        c = ui->cell[i] = ui->next[i];
+        fprintf(ui->term, "\033[%d;%dH", i / cols + 1, i % cols + 1);
+        if (c)          /* U+2800 + dots, in UTF-8 */
+            fprintf(ui->term, "%c%c%c", 0xE2, 0xA0 | (c >> 6), 0x80 | (c & 0x3F));
+        else
+            fputc (' ', ui->term);
+        }
+fprintf(ui->term, "\033[%d;1H", rows);  /* back to status line */
+fflush (ui->term);
+}
+
+
+/********************************************************
+* tui_close: Restores the terminal.                     *
+* Input:    ptr to chart                                *
+* Return:   Nothing.                                    *
+********************************************************/
+void tui_close (struct tui *ui)
+{
+fprintf(ui->term, "\033[%d;1H\033[?25h\n", ui->rows);
+free (ui->cell);
+free (ui->next);
+}
+
+
+/********************************************************
+* derive_open: Prepares the window for dV/dI.           *
+* Input:    - ptr to derived channels                   *
+*           - size of window                            *
+* Return:   1 if OK, 0 if error                         *
+********************************************************/
+int derive_open (struct derive *d, const int n)
+{
+memset (d, 0, sizeof(*d));
+d->n = n;
+d->v = malloc(n * sizeof(long));
+d->i = malloc(n * sizeof(long));
+if (NULL == d->v || NULL == d->i)
+    {
+    fprintf(stderr, "Out of memory!\n");
+    return 0;
+    }
+return 1;
+}
+
+
+/********************************************************
+* derive_add: Adds a reading to the window and returns  *
+*           the slope of the least-squares line V(I)    *
+*           through it. The sums are kept as integers,  *
+*           so they do not drift when the oldest        *
+*           reading is taken out again.                 *
+* Input:    - ptr to derived channels                   *
+*           - voltage and current (fixed point)         *
+*           - ptr to slope dV/dI (fixed point, Ohm)     *
+* Return:   1 if slope is defined, 0 if not (too few    *
+*           readings, or current did not change)        *
+********************************************************/
+int derive_add (struct derive *d, const long v, const long i, long *slope)
+{
+long long num, den;
+
+if (d->fill == d->n)        /* window full, drop the oldest */
+    {
+    d->sv -= d->v[d->k];
+    d->si -= d->i[d->k];
+    d->sii -= (long long)d->i[d->k] * d->i[d->k];
+    d->siv -= (long long)d->i[d->k] * d->v[d->k];
+    }
+else
+    d->fill++;
+d->v[d->k] = v;
+d->i[d->k] = i;
+d->sv += v;
+d->si += i;
+d->sii += (long long)i * i;
+d->siv += (long long)i * v;
+d->k = (d->k + 1) % d->n;
+
+num = d->fill * d->siv - d->si * d->sv;
+den = d->fill * d->sii - d->si * d->si;
+if (d->fill < 2 || den == 0)
+    return 0;
+*slope = llround((double)num * FIX_SCALE / den);
+return 1;
+}
+
+
+/********************************************************
+* derive_close: Frees the window.                       *
+* Input:    ptr to derived channels                     *
+* Return:   Nothing.                                    *
+********************************************************/
+void derive_close (struct derive *d)
+{
+free (d->v);
+free (d->i);
+d->v = d->i = NULL;
+}
+
+
+/********************************************************
+* p2_init: Prepares the estimation of a quantile with   *
+*          the P-square algorithm (R. Jain, I. Chlamtac,*
+*          Comm. ACM 28, 1076 (1985)), which keeps only *
+*          five markers instead of all readings.        *
+* Input:    - ptr to estimator                          *
+*           - quantile (0.5 for the median etc.)        *
+* Return:   Nothing.                                    *
+********************************************************/
+void p2_init (struct p2 *p, const double prob)
+{
+memset (p, 0, sizeof(*p));
+p->prob = prob;
+p->dn[1] = prob / 2;
+p->dn[2] = prob;
+p->dn[3] = (1 + prob) / 2;
+p->dn[4] = 1;
+}
+
+
+/********************************************************
+* p2_add: Adds a reading to the estimation.             *
+* Input:    - ptr to estimator                          *
+*           - reading                                   *
+* Return:   Nothing.                                    *
+********************************************************/
+void p2_add (struct p2 *p, const double x)
+{
+double  d, s, q;
+int     i, k;
+
+if (p->count < 5)           /* the first five are just kept */
+    {
+    p->q[p->count++] = x;
+    if (p->count == 5)
+        {
+        qsort (p->q, 5, sizeof(double), cmp_double);
+        for (i = 0; i < 5; i++)
+            {
+            p->n[i] = i;
+            p->np[i] = 4 * p->dn[i];
+            }
+        }
+    return;
+    }
+
+if (x < p->q[0])            /* find the cell of x, evtl. extend range */
+    {
+    p->q[0] = x;
+    k = 0;
+    }
+else if (x >= p->q[4])
+    {
+    p->q[4] = x;
+    k = 3;
+    }
+else
+    for (k = 0; x >= p->q[k+1]; k++)
+        ;
+for (i = k + 1; i < 5; i++)
+    p->n[i]++;
+for (i = 0; i < 5; i++)
+    p->np[i] += p->dn[i];
+p->count++;
+
+for (i = 1; i < 4; i++)     /* move the middle markers if off */
+    {
+    d = p->np[i] - p->n[i];
+    if ((d >= 1 && p->n[i+1] - p->n[i] > 1) || (d <= -1 && p->n[i-1] - p->n[i] < -1))
+        {
+        s = (d > 0 ? 1 : -1);
+        q = p->q[i] + s / (p->n[i+1] - p->n[i-1]) *
+            ((p->n[i] - p->n[i-1] + s) * (p->q[i+1] - p->q[i]) / (p->n[i+1] - p->n[i]) +
+             (p->n[i+1] - p->n[i] - s) * (p->q[i] - p->q[i-1]) / (p->n[i] - p->n[i-1]));
+        if (q <= p->q[i-1] || q >= p->q[i+1])   /* parabola overshoots, go linear */
+            q = p->q[i] + s * (p->q[i+(int)s] - p->q[i]) / (p->n[i+(int)s] - p->n[i]);
+        p->q[i] = q;
+        p->n[i] += s;
+        }
+    }
+}
+
+
+/********************************************************
+* p2_get: Current estimate of the quantile.             *
+* Input:    ptr to estimator                            *
+* Return:   estimate (0 if no readings)                 *
+********************************************************/
+double p2_get (const struct p2 *p)
+{
+double  q[5];
+
+if (p->count == 0)
+    return 0.0;
+if (p->count < 5)           /* few readings, take the nearest one */
+    {
+    memcpy (q, p->q, sizeof(q));
+    qsort (q, p->count, sizeof(double), cmp_double);
+    return q[lround(p->prob * (p->count - 1))];
+    }
+return p->q[2];
+}
+
+
+/********************************************************
+* hist_add: Counts a reading in its histogram bucket.   *
+*           Bucket k holds 10^(k/HIST_DEC) to the next  *
+*           one, in units of 0.1 mA.                    *
+* Input:    - ptr to histogram                          *
+*           - current (fixed point)                     *
+* Return:   Nothing.                                    *
+********************************************************/
+void hist_add (struct hist *h, const long amp)
+{
+int     k;
+
+if (amp <= 0)
+    {
+    h->below++;
+    return;
+    }
+k = (int)floor(HIST_DEC * log10((double)amp));
+h->n[(k < HIST_LEN) ? k : HIST_LEN - 1]++;
+}
+
+
+/********************************************************
+* hist_print: Shows the histogram as bar chart, and     *
+*           writes it to the data file.                 *
+* Input:    - ptr to histogram                          *
+*           - console and data file                     *
+* Return:   Nothing.                                    *
+********************************************************/
+void hist_print (const struct hist *h, FILE *con, FILE *f)
+{
+unsigned long max = h->below;
+char    bar[HIST_BAR+1];
+int     k, lo, hi;
+
+for (lo = 0; lo < HIST_LEN && !h->n[lo]; lo++)
+    ;
+for (hi = HIST_LEN - 1; hi >= lo && !h->n[hi]; hi--)
+    ;
+for (k = lo; k <= hi; k++)
+    if (h->n[k] > max)
+        max = h->n[k];
+
+fprintf(con, "\n\nHistogram of current (A):");
+fprintf(f, "# Histogram: from A, readings\n");
+if (h->below)
+    {
+    memset (bar, '#', HIST_BAR * h->below / max);
+    bar[HIST_BAR * h->below / max] = '\0';
+    fprintf(con, "\n %9s %10lu %s", "<= 0", h->below, bar);
+    fprintf(f, "#   %.4f\t%lu\n", 0.0, h->below);
+    }
+for (k = lo; k <= hi; k++)  /* empty buckets between are shown, too */
+    {
+    memset (bar, '#', HIST_BAR * h->n[k] / max);
+    bar[HIST_BAR * h->n[k] / max] = '\0';
+    fprintf(con, "\n %9.4f %10lu %s", pow(10.0, (double)k / HIST_DEC) / FIX_SCALE, h->n[k], bar);
+    fprintf(f, "#   %.4f\t%lu\n", pow(10.0, (double)k / HIST_DEC) / FIX_SCALE, h->n[k]);
+    }
+}
+
+
+/********************************************************
+* rule_parse: Reads a limit rule, e.g. 'I>0.5:off'.     *
+* Input:    - ptr to rule                               *
+*           - text of rule                              *
+* Return:   1 if OK, 0 if error                         *
+********************************************************/
+int rule_parse (struct rule *r, const char *spec)
+{
+static const char *names[RULE_NVAL] = { "V", "I", "P", "Imean", "Ah" },
+                  *actions[] = { "fail", "off", "stop" };
+const char *p = spec + strcspn(spec, "<>");
+char    *q;
+int     i;
+
+memset (r, 0, sizeof(*r));
+snprintf (r->text, MAXLEN, "%s", spec);
+r->what = -1;
+for (i = 0; i < RULE_NVAL; i++)
+    if (strlen(names[i]) == (size_t)(p - spec) && !strncmp(spec, names[i], p - spec))
+        r->what = i;
+r->op = *p;
+r->action = RULE_STOP;
+if (r->what >= 0 && *p)
+    {
+    r->lim = strtod(p + 1, &q);
+    if (q > p + 1 && *q == '\0')
+        return 1;
+    if (q > p + 1 && *q == ':')
+        for (i = 0; i < 3; i++)
+            if (!strcmp(q + 1, actions[i]))
+                {
+                r->action = i;
+                return 1;
+                }
+    }
+fprintf(stderr, "Error: limit '%s' is not like 'I>0.5' or 'V<4.8:off' (V, I, P, Imean, Ah; fail, off, stop).\n", spec);
+return 0;
+}
+
+
+/********************************************************
+* rule_check: Checks a limit rule.                      *
+* Input:    - ptr to rule                               *
+*           - ptr to quantities: V, I, P, Imean, Ah     *
+* Return:   1 if violated, 0 if not                     *
+********************************************************/
+int rule_check (const struct rule *r, const double *val)
+{
+if (r->op == '>')
+    return (val[r->what] > r->lim);
+return (val[r->what] < r->lim);
+}
+
+
+/********************************************************
+* CRC32_UPDATE: CRC-32 (as used by zip, PNG etc.)       *
+* Input:    - CRC so far (0 for start)                  *
+*           - ptr to data, and their length             *
+* Return:   updated CRC                                 *
+********************************************************/
+unsigned long crc32_update (unsigned long crc, const unsigned char *buf, size_t len)
+{
+static unsigned long table[256];
+unsigned long c;
+int     i, k;
+
+if (table[1] == 0)          /* first call: build table */
+    for (i = 0; i < 256; i++)
+        {
+        for (c = i, k = 0; k < 8; k++)
+            c = (c & 1) ? 0xEDB88320UL ^ (c >> 1) : c >> 1;
+        table[i] = c;
+        }
+
+crc ^= 0xFFFFFFFFUL;
+while (len--)
+    crc = table[(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+return crc ^ 0xFFFFFFFFUL;
+}
+
+
+/********************************************************
+* TIMEINFO: Returns actual time elapsed since The Epoch *
+* Input:    Nothing.                                    *
+* Return:   time in microseconds                        *
+* Note:     #include <time.h>                           *
+*           #include <sys/time.h>                       *
+********************************************************/
+double timeinfo (void)
+{
+struct timeval t;
+
+gettimeofday(&t, NULL);
+return (double)t.tv_sec + (double)t.tv_usec/1000000.0;
+}
+
+
+/********************************************************
+* CLOCK_NS: Gets wall clock time in ns                  *
+* Input:    Nothing                                     *
+* Return:   ns since The Epoch                          *
+********************************************************/
+long long clock_ns (void)
+{
+struct timespec t;
+
+clock_gettime(CLOCK_REALTIME, &t);
+return (long long)t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+
+/********************************************************
+* FIX_PARSE: Converts a reading such as "12.3456" to    *
+*           fixed point (1/FIX_SCALE units), rounding   *
+*           any further digits. Exponents ("1.2E+01")   *
+*           are left to strtod().                       *
+* Input:    - string                                    *
+*           - ptr to long for result                    *
+* Return:   1 if OK, 0 if no number                     *
+********************************************************/
+int fix_parse (const char *s, long *val)
+{
+const char *start;
+char    *end;
+long    v = 0, scale = FIX_SCALE;
+int     neg = 0, digits = 0;
+
+while (*s == ' ' || *s == '\t')
+    s++;
+start = s;
+if (*s == '+' || *s == '-')
+    neg = (*s++ == '-');
+for (; isdigit((unsigned char)*s); s++, digits++)
+    v = 10 * v + (*s - '0');
+v *= FIX_SCALE;
+if (*s == '.')
+    for (s++; isdigit((unsigned char)*s); s++, digits++)
+        {
+        if (scale > 1)
+            v += (*s - '0') * (scale /= 10);
+        else if (scale == 1)        /* first digit too many: round */
+            {
+            v += (*s >= '5');
+            scale = 0;
+            }
+        }
+if (!digits)
+    return 0;
+if (*s == 'E' || *s == 'e')
+    {
+    *val = lround(strtod(start, &end) * FIX_SCALE);
+    return 1;
+    }
+*val = (neg ? -v : v);
+return 1;
+}
+
+
+/********************************************************
+* FIX_PUT:  Writes a fixed point value with 4 decimals  *
+*           (FIX_SCALE = 10000), like "%.4f" would.     *
+* Input:    - ptr to buffer (24 chars are enough)       *
+*           - value                                     *
+* Return:   ptr to the terminating '\0'                 *
+********************************************************/
+char *fix_put (char *p, long long val)
+{
+char    tmp[24];
+int     n = 0;
+
+if (val < 0)
+    {
+    *p++ = '-';
+    val = -val;
+    }
+do  {
+    tmp[n++] = '0' + val % 10;
+    val /= 10;
+    if (n == 4)
+        tmp[n++] = '.';
+    }
+    while (val || n < 6);
+while (n)
+    *p++ = tmp[--n];
+*p = '\0';
+return p;
+}
+
+
+/********************************************************
+* ramp_table: Computes all setpoints of a ramp, on the  *
+*           exact grid of 'lo' (or 'hi', if 'inc' is    *
+*           negative) plus multiples of 'inc'. A dual   *
+*           ramp then runs back the same way.           *
+* Input:    - lower and upper end (fixed point)         *
+*           - increment (fixed point), sign = direction *
+*           - flag for dual ramp                        *
+*           - ptr to int for number of setpoints        *
+*           - ptr to int for index of first setpoint on *
+*             the way back (0 if none)                  *
+* Return:   ptr to table (to be free'd), NULL if error  *
+********************************************************/
+long *ramp_table (const long lo, const long hi, const long inc, const char dual,
+                  int *n, int *turn)
+{
+long    *tab, v;
+
+*n = *turn = 0;
+if (NULL == (tab = malloc((2 * (hi - lo) / labs(inc) + 2) * sizeof(long))))
+    {
+    fprintf(stderr, "Out of memory!\n");
+    return NULL;
+    }
+v = (inc > 0 ? lo : hi);
+while (v + inc >= lo && v + inc <= hi)
+    tab[(*n)++] = (v += inc);
+if (dual && *n)
+    {
+    *turn = *n;
+    while (v - inc >= lo && v - inc <= hi)
+        tab[(*n)++] = (v -= inc);
+    }
+return tab;
+}
+
+
+/********************************************************
+* ref_table: Reads a reference I-V curve (a data file   *
+*           of an earlier ramp: V and I in the 2nd and  *
+*           3rd column) and interpolates the expected   *
+*           current at each setpoint, so that checking  *
+*           a reading is just a look-up.                *
+* Input:    - file name                                 *
+*           - setpoints (fixed point), and number       *
+* Return:   ptr to currents (fixed point, REF_NONE if   *
+*           outside the curve; to be free'd), NULL if   *
+*           error                                       *
+********************************************************/
+long *ref_table (const char *name, const long *tab, const int n)
+{
+FILE    *f;
+char    buf[4*MAXLEN];
+double  t, *v = NULL, *a = NULL, x;
+long    *ref;
+int     i, k, m = 0, size = 0;
+
+if (NULL == (f = fopen(name, "rt")))
+    {
+    fprintf(stderr, "Could not open '%s' for reading.\n", name);
+    return NULL;
+    }
+while (fgets(buf, sizeof(buf), f))
+    {
+    if (buf[0] == '#')
+        continue;
+    if (m == size && (NULL == (v = realloc(v, (size += 1024) * sizeof(double))) ||
+                      NULL == (a = realloc(a, size * sizeof(double)))))
+        {
+        fprintf(stderr, "Out of memory!\n");
+        fclose (f);
+        return NULL;
+        }
+    if (3 == sscanf(buf, "%lf %lf %lf", &t, &v[m], &a[m]))
+        m++;
+    }
+fclose (f);
+
+if (m < 2 || NULL == (ref = malloc(n * sizeof(long))))
+    {
+    fprintf(stderr, "No reference curve in '%s'.\n", name);
+    free (v);
+    free (a);
+    return NULL;
+    }
+for (i = 0; i < n; i++)     /* first segment of the curve that covers it */
+    {
+    x = (double)tab[i] / FIX_SCALE;
+    ref[i] = REF_NONE;
+    for (k = 1; k < m; k++)
+        if ((v[k-1] <= x && x <= v[k]) || (v[k] <= x && x <= v[k-1]))
+            {
+            ref[i] = FIX(v[k] == v[k-1] ? a[k] :
+                         a[k-1] + (a[k] - a[k-1]) * (x - v[k-1]) / (v[k] - v[k-1]));
+            break;
+            }
+    }
+free (v);
+free (a);
+return ref;
+}
+
+
+/********************************************************
+* CMP_DOUBLE: Comparison function for qsort()           *
+* Input:    Pointers to the two doubles                 *
+* Return:   <0, 0, >0 as for strcmp()                   *
+********************************************************/
+int cmp_double (const void *a, const void *b)
+{
+double  x = *(const double *)a, y = *(const double *)b;
+
+return (x > y) - (x < y);
 }
 
 